@@ -48,4 +48,37 @@ else()
     
 endif()
 
+# Optional trace zones around the Arabic text pipeline (Chrome trace JSON,
+# plus Tracy when the viewer is built with it)
+option(ARABIC_TRACING "Trace the Arabic text pipeline" OFF)
+if(ARABIC_TRACING)
+    add_definitions(-DLL_ARABIC_TRACING=1)
+    message(STATUS "Arabic text pipeline tracing enabled")
+endif()
+
+# Optional cache shared between viewer instances on one machine (POSIX shared
+# memory, so not on Windows)
+option(ARABIC_SHARED_CACHE "Share the Arabic text cache between viewer instances" OFF)
+if(ARABIC_SHARED_CACHE AND NOT WINDOWS)
+    add_definitions(-DLL_ARABIC_SHARED_CACHE=1)
+    # shm_open() lives in librt before glibc 2.34
+    find_library(RT_LIBRARY rt)
+    if(RT_LIBRARY)
+        link_libraries(${RT_LIBRARY})
+    endif()
+    message(STATUS "Arabic shared text cache enabled")
+endif()
+
+# Optional allocation budget test, built from test_arabic_memory.cpp copied
+# next to llarabicsupport.cpp. The budgets assume shaping, so give it the
+# Arabic font with ARABIC_MEMORY_TEST_FONT; run it with ctest -R arabic_memory
+option(ARABIC_MEMORY_TEST "Build the Arabic text allocation budget test" OFF)
+set(ARABIC_MEMORY_TEST_FONT "" CACHE FILEPATH "Font for the Arabic allocation budget test")
+if(ARABIC_MEMORY_TEST AND EXISTS ${CMAKE_CURRENT_SOURCE_DIR}/test_arabic_memory.cpp)
+    add_executable(test_arabic_memory test_arabic_memory.cpp)
+    target_link_libraries(test_arabic_memory llui)
+    add_test(NAME arabic_memory COMMAND test_arabic_memory ${ARABIC_MEMORY_TEST_FONT})
+    message(STATUS "Arabic allocation budget test enabled")
+endif()
+
 message(STATUS "Arabic language support enabled")
@@ -19,345 +19,4148 @@
 // FreeType includes
 #include <ft2build.h>
 #include FT_FREETYPE_H
+#include FT_SIZES_H
 
 // Standard includes
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
 #include <codecvt>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <locale>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <thread>
+
+// Font file checks
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// Warnings go to the viewer log inside the viewer, to stderr elsewhere
+#if __has_include("llerror.h")
+#include "llerror.h"
+#define LL_ARABIC_WARN(message) LL_WARNS("Arabic") << message << LL_ENDL
+#else
+#include <iostream>
+#define LL_ARABIC_WARN(message) std::cerr << "Arabic: " << message << std::endl
+#endif
+
+// SSE2 is part of every x86-64 target, so it needs no runtime check
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LL_ARABIC_SSE2 1
+#include <emmintrin.h>
+#else
+#define LL_ARABIC_SSE2 0
+#endif
+
+// POSIX shared memory for the cache shared between viewer instances
+#if LL_ARABIC_SHARED_CACHE
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 //-----------------------------------------------------------------------------
-// LLArabicSupport implementation
+// Pipeline tracing
+//
+// Build with LL_ARABIC_TRACING to get scoped zones around every stage of the
+// pipeline. Zones are written as Chrome trace events (chrome://tracing,
+// Perfetto) between startTrace() and stopTrace(), and are also sent to Tracy
+// when the viewer is built with TRACY_ENABLE. Without LL_ARABIC_TRACING the
+// macros expand to nothing.
+//-----------------------------------------------------------------------------
+
+#if LL_ARABIC_TRACING
+
+#ifdef TRACY_ENABLE
+#include "tracy/Tracy.hpp"
+#endif
+
+namespace
+{
+    class LLArabicTraceLog
+    {
+    public:
+        static LLArabicTraceLog& instance()
+        {
+            static LLArabicTraceLog sInstance;
+            return sInstance;
+        }
+        
+        bool isActive() const { return mActive.load(std::memory_order_relaxed); }
+        
+        bool start(const std::string& filename)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mFile)
+            {
+                return false;
+            }
+            mFile = fopen(filename.c_str(), "w");
+            if (!mFile)
+            {
+                return false;
+            }
+            fputs("{\"traceEvents\":[\n", mFile);
+            mFirstEvent = true;
+            mStart = std::chrono::steady_clock::now();
+            mActive.store(true, std::memory_order_release);
+            return true;
+        }
+        
+        void stop()
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mActive.store(false, std::memory_order_release);
+            if (mFile)
+            {
+                fputs("\n]}\n", mFile);
+                fclose(mFile);
+                mFile = nullptr;
+            }
+        }
+        
+        void write(const char* name, std::chrono::steady_clock::time_point begin,
+                   std::chrono::steady_clock::time_point end, long long length,
+                   const char* cache)
+        {
+            static std::atomic<int> sNextThreadId(1);
+            static thread_local int sThreadId = sNextThreadId++;
+            
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (!mFile)
+            {
+                return;
+            }
+            double ts = std::chrono::duration<double, std::micro>(begin - mStart).count();
+            double dur = std::chrono::duration<double, std::micro>(end - begin).count();
+            fprintf(mFile,
+                    "%s{\"name\":\"%s\",\"cat\":\"arabic\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+                    mFirstEvent ? "" : ",\n", name, sThreadId, ts, dur);
+            if (length >= 0)
+            {
+                fprintf(mFile, "\"length\":%lld%s", length, cache ? "," : "");
+            }
+            if (cache)
+            {
+                fprintf(mFile, "\"cache\":\"%s\"", cache);
+            }
+            fputs("}}", mFile);
+            mFirstEvent = false;
+        }
+        
+    private:
+        LLArabicTraceLog()
+            : mActive(false)
+            , mFile(nullptr)
+            , mFirstEvent(true)
+        {
+        }
+        
+        std::atomic<bool> mActive;
+        std::mutex mMutex;
+        FILE* mFile;
+        bool mFirstEvent;
+        std::chrono::steady_clock::time_point mStart;
+    };
+    
+    /**
+     * One trace zone; costs a relaxed load when no trace is being written
+     */
+    class LLArabicTraceZone
+    {
+    public:
+        explicit LLArabicTraceZone(const char* name)
+            : mName(name)
+            , mActive(LLArabicTraceLog::instance().isActive())
+            , mLength(-1)
+            , mCache(nullptr)
+        {
+            if (mActive)
+            {
+                mBegin = std::chrono::steady_clock::now();
+            }
+        }
+        
+        ~LLArabicTraceZone()
+        {
+            if (mActive)
+            {
+                LLArabicTraceLog::instance().write(mName, mBegin, std::chrono::steady_clock::now(),
+                                                   mLength, mCache);
+            }
+        }
+        
+        void setLength(size_t length) { mLength = static_cast<long long>(length); }
+        void setCache(const char* outcome) { mCache = outcome; }
+        
+    private:
+        const char* mName;
+        bool mActive;
+        long long mLength;
+        const char* mCache;
+        std::chrono::steady_clock::time_point mBegin;
+    };
+}
+
+#ifdef TRACY_ENABLE
+#define LL_ARABIC_TRACE_ZONE(zone, name) \
+    ZoneNamedN(zone##_tracy, name, true); LLArabicTraceZone zone(name)
+#define LL_ARABIC_TRACE_LENGTH(zone, length) \
+    ZoneValueV(zone##_tracy, static_cast<uint64_t>(length)); zone.setLength(length)
+#define LL_ARABIC_TRACE_CACHE(zone, outcome) \
+    ZoneTextV(zone##_tracy, outcome, strlen(outcome)); zone.setCache(outcome)
+#else
+#define LL_ARABIC_TRACE_ZONE(zone, name) LLArabicTraceZone zone(name)
+#define LL_ARABIC_TRACE_LENGTH(zone, length) zone.setLength(length)
+#define LL_ARABIC_TRACE_CACHE(zone, outcome) zone.setCache(outcome)
+#endif
+
+#else // LL_ARABIC_TRACING
+
+#define LL_ARABIC_TRACE_ZONE(zone, name)
+#define LL_ARABIC_TRACE_LENGTH(zone, length)
+#define LL_ARABIC_TRACE_CACHE(zone, outcome)
+
+#endif // LL_ARABIC_TRACING
+
+//-----------------------------------------------------------------------------
+// LLArabicFrequencySketch
+//
+// Count-min sketch of 4-bit counters, used as the TinyLFU admission filter of
+// the text cache. Every lookup is recorded, so the sketch knows how often a
+// string was requested recently even when it was never admitted. Counters are
+// halved once the sample size is reached so that old popularity fades.
+//-----------------------------------------------------------------------------
+
+class LLArabicFrequencySketch
+{
+public:
+    LLArabicFrequencySketch()
+        : mSampleSize(0)
+        , mAdditions(0)
+    {
+        resize(0);
+    }
+    
+    void resize(size_t capacity)
+    {
+        // One 64-bit word holds 16 counters; aim for ~16 counters per entry
+        size_t words = 16;
+        while (words < capacity)
+        {
+            words <<= 1;
+        }
+        mTable.assign(words, 0);
+        mSampleSize = 10 * std::max<size_t>(capacity, 64);
+        mAdditions = 0;
+    }
+    
+    void clear()
+    {
+        std::fill(mTable.begin(), mTable.end(), 0);
+        mAdditions = 0;
+    }
+    
+    void increment(size_t hash)
+    {
+        bool added = false;
+        for (int row = 0; row < ROWS; ++row)
+        {
+            size_t counter = counterIndex(hash, row);
+            uint64_t& word = mTable[counter >> 4];
+            int shift = static_cast<int>(counter & 15) << 2;
+            if (((word >> shift) & 0xF) < 0xF)
+            {
+                word += uint64_t(1) << shift;
+                added = true;
+            }
+        }
+        
+        if (added && ++mAdditions >= mSampleSize)
+        {
+            age();
+        }
+    }
+    
+    unsigned int frequency(size_t hash) const
+    {
+        unsigned int freq = 0xF;
+        for (int row = 0; row < ROWS; ++row)
+        {
+            size_t counter = counterIndex(hash, row);
+            int shift = static_cast<int>(counter & 15) << 2;
+            unsigned int count = static_cast<unsigned int>((mTable[counter >> 4] >> shift) & 0xF);
+            freq = std::min(freq, count);
+        }
+        return freq;
+    }
+    
+private:
+    static const int ROWS = 4;
+    
+    size_t counterIndex(size_t hash, int row) const
+    {
+        static const uint64_t SEEDS[ROWS] = {
+            0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+            0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL
+        };
+        uint64_t h = (static_cast<uint64_t>(hash) + SEEDS[row]) * SEEDS[row];
+        h ^= h >> 32;
+        return static_cast<size_t>(h & ((mTable.size() << 4) - 1));
+    }
+    
+    void age()
+    {
+        // Halve every counter at once
+        for (uint64_t& word : mTable)
+        {
+            word = (word >> 1) & 0x7777777777777777ULL;
+        }
+        mAdditions /= 2;
+    }
+    
+    std::vector<uint64_t> mTable;
+    size_t mSampleSize;
+    size_t mAdditions;
+};
+
+//-----------------------------------------------------------------------------
+// LLArabicEpochDomain
+//
+// Epoch-based reclamation for the lock-free read path of the text cache.
+// Readers publish the global epoch while they hold pointers into the cache;
+// writers retire unlinked memory and free it once every reader that could
+// still see it has left. Each thread owns one record, which also carries its
+// cache counters so that readers never write to shared cache lines.
+//-----------------------------------------------------------------------------
+
+namespace
+{
+    const size_t CACHE_LINE_SIZE = 64;
+    const size_t READ_BUFFER_SIZE = 32;
+    
+    struct alignas(CACHE_LINE_SIZE) LLArabicThreadRecord
+    {
+        std::atomic<uint64_t> mEpoch;       // 0 while not reading
+        std::atomic<bool> mInUse;
+        int mNesting;
+        
+        // Written by the owning thread only
+        std::atomic<size_t> mHits[LLArabicSupport::CACHE_POOL_COUNT];
+        std::atomic<size_t> mMisses[LLArabicSupport::CACHE_POOL_COUNT];
+        std::atomic<size_t> mLocalHits[LLArabicSupport::CACHE_POOL_COUNT];
+        std::atomic<size_t> mRunHits[LLArabicSupport::CACHE_POOL_COUNT];
+        std::atomic<size_t> mRunMisses[LLArabicSupport::CACHE_POOL_COUNT];
+        
+        // Recent lookups, drained into the frequency sketch in batches
+        uint64_t mReadBuffer[READ_BUFFER_SIZE];
+        size_t mReadCount;
+        
+        LLArabicThreadRecord* mNext;
+        
+        LLArabicThreadRecord()
+            : mEpoch(0)
+            , mInUse(true)
+            , mNesting(0)
+            , mReadCount(0)
+            , mNext(nullptr)
+        {
+            for (int i = 0; i < LLArabicSupport::CACHE_POOL_COUNT; ++i)
+            {
+                mHits[i].store(0, std::memory_order_relaxed);
+                mMisses[i].store(0, std::memory_order_relaxed);
+                mLocalHits[i].store(0, std::memory_order_relaxed);
+                mRunHits[i].store(0, std::memory_order_relaxed);
+                mRunMisses[i].store(0, std::memory_order_relaxed);
+            }
+        }
+    };
+}
+
+class LLArabicEpochDomain
+{
+public:
+    typedef void (*deleter_t)(void*);
+    
+    static LLArabicEpochDomain& instance()
+    {
+        // Never destroyed: thread records may outlive static destruction
+        static LLArabicEpochDomain* sInstance = new LLArabicEpochDomain();
+        return *sInstance;
+    }
+    
+    LLArabicThreadRecord& threadRecord()
+    {
+        static thread_local RecordHolder sHolder;
+        if (!sHolder.mRecord)
+        {
+            sHolder.mRecord = acquireRecord();
+        }
+        return *sHolder.mRecord;
+    }
+    
+    LLArabicThreadRecord* firstRecord() const
+    {
+        return mRecords.load(std::memory_order_acquire);
+    }
+    
+    void enter(LLArabicThreadRecord& record)
+    {
+        if (record.mNesting++ == 0)
+        {
+            record.mEpoch.store(mGlobalEpoch.load(std::memory_order_acquire),
+                                std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+    
+    void exit(LLArabicThreadRecord& record)
+    {
+        if (--record.mNesting == 0)
+        {
+            record.mEpoch.store(0, std::memory_order_release);
+        }
+    }
+    
+    // Free ptr once no reader can still hold it. Large blocks (bytes)
+    // make reclamation run sooner.
+    void retire(void* ptr, deleter_t deleter, size_t bytes = 0)
+    {
+        std::lock_guard<std::mutex> lock(mRetireMutex);
+        mRetired.push_back(Retired{ ptr, deleter, mGlobalEpoch.load(std::memory_order_relaxed), bytes });
+        mRetiredBytes += bytes;
+        if (mRetired.size() >= RECLAIM_THRESHOLD || mRetiredBytes >= RECLAIM_BYTES)
+        {
+            reclaim();
+        }
+    }
+    
+    // Free whatever no reader holds any more, now
+    void collect()
+    {
+        std::lock_guard<std::mutex> lock(mRetireMutex);
+        
+        // Two epoch advances make everything retired so far unreachable
+        // unless a reader is still inside its critical section
+        reclaim();
+        reclaim();
+    }
+    
+    // Free everything immediately; only valid when no reader is active
+    void reclaimAll()
+    {
+        std::lock_guard<std::mutex> lock(mRetireMutex);
+        for (const Retired& item : mRetired)
+        {
+            item.mDeleter(item.mPtr);
+        }
+        mRetired.clear();
+        mRetiredBytes = 0;
+    }
+    
+private:
+    static const size_t RECLAIM_THRESHOLD = 64;
+    static const size_t RECLAIM_BYTES = 256 * 1024;
+    
+    struct Retired
+    {
+        void* mPtr;
+        deleter_t mDeleter;
+        uint64_t mEpoch;
+        size_t mBytes;
+    };
+    
+    struct RecordHolder
+    {
+        LLArabicThreadRecord* mRecord = nullptr;
+        ~RecordHolder()
+        {
+            if (mRecord)
+            {
+                mRecord->mInUse.store(false, std::memory_order_release);
+            }
+        }
+    };
+    
+    LLArabicEpochDomain()
+        : mGlobalEpoch(1)
+        , mRecords(nullptr)
+        , mRetiredBytes(0)
+    {
+    }
+    
+    LLArabicThreadRecord* acquireRecord()
+    {
+        // Reuse a record released by an exited thread
+        for (LLArabicThreadRecord* record = firstRecord(); record; record = record->mNext)
+        {
+            bool expected = false;
+            if (record->mInUse.compare_exchange_strong(expected, true))
+            {
+                record->mNesting = 0;
+                record->mReadCount = 0;
+                return record;
+            }
+        }
+        
+        LLArabicThreadRecord* record = new LLArabicThreadRecord();
+        LLArabicThreadRecord* head = mRecords.load(std::memory_order_relaxed);
+        do
+        {
+            record->mNext = head;
+        } while (!mRecords.compare_exchange_weak(head, record,
+                                                 std::memory_order_release,
+                                                 std::memory_order_relaxed));
+        return record;
+    }
+    
+    // Called with mRetireMutex held
+    void reclaim()
+    {
+        // Advance the epoch if every active reader has seen the current one
+        uint64_t epoch = mGlobalEpoch.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool quiescent = true;
+        for (LLArabicThreadRecord* record = firstRecord(); record; record = record->mNext)
+        {
+            uint64_t reader_epoch = record->mEpoch.load(std::memory_order_acquire);
+            if (reader_epoch != 0 && reader_epoch != epoch)
+            {
+                quiescent = false;
+                break;
+            }
+        }
+        if (quiescent)
+        {
+            mGlobalEpoch.compare_exchange_strong(epoch, epoch + 1);
+        }
+        
+        // Memory retired two epochs ago is unreachable for every reader
+        uint64_t current = mGlobalEpoch.load(std::memory_order_relaxed);
+        auto keep = std::partition(mRetired.begin(), mRetired.end(),
+            [current](const Retired& item) { return item.mEpoch + 2 > current; });
+        for (auto it = keep; it != mRetired.end(); ++it)
+        {
+            mRetiredBytes -= it->mBytes;
+            it->mDeleter(it->mPtr);
+        }
+        mRetired.erase(keep, mRetired.end());
+    }
+    
+    std::atomic<uint64_t> mGlobalEpoch;
+    std::atomic<LLArabicThreadRecord*> mRecords;
+    std::mutex mRetireMutex;
+    std::vector<Retired> mRetired;
+    size_t mRetiredBytes;
+};
+
+/**
+ * Scoped read-side critical section
+ */
+class LLArabicEpochGuard
+{
+public:
+    LLArabicEpochGuard()
+        : mDomain(LLArabicEpochDomain::instance())
+        , mRecord(mDomain.threadRecord())
+    {
+        mDomain.enter(mRecord);
+    }
+    
+    ~LLArabicEpochGuard()
+    {
+        mDomain.exit(mRecord);
+    }
+    
+    LLArabicThreadRecord& record() { return mRecord; }
+    
+private:
+    LLArabicEpochDomain& mDomain;
+    LLArabicThreadRecord& mRecord;
+};
+
+//-----------------------------------------------------------------------------
+// LLArabicTextCache
+//
+// Shared processed-text cache. Entries live in sharded open-addressing tables
+// of atomic pointers: lookups take no lock and never write shared memory
+// except to set an entry's CLOCK reference bit the first time it is hit.
+// Inserts and evictions lock only their shard, publish with release stores
+// and hand unlinked memory to the epoch domain, so readers are never blocked.
+//
+// Entries are not heap blocks of their own but records appended to large
+// per-shard slabs: a small header, the value (as wchar_t, so callers can
+// borrow it) and the key as UTF-16. Budgets are in bytes. An evicted record
+// leaves a hole; a slab is freed once all its records are gone, and a shard
+// whose slabs are mostly holes is repacked into fresh ones.
+//
+// Each pool has its own budget. When a pool is full within a shard a CLOCK
+// sweep picks the victim, and a new string is only admitted if the frequency
+// sketch says it is requested more often than that victim, so a scan of
+// one-off strings cannot flush entries that are actually reused.
 //-----------------------------------------------------------------------------
 
-LLArabicSupport& LLArabicSupport::instance()
+class LLArabicTextCache
+{
+public:
+    typedef LLArabicSupport::ECachePool ECachePool;
+    
+    LLArabicTextCache()
+        : mSlabSize(MAX_SLAB_SIZE)
+    {
+        for (Shard& shard : mShards)
+        {
+            shard.mTable.store(new SlotTable(MIN_SLOTS), std::memory_order_relaxed);
+        }
+        for (int i = 0; i < LLArabicSupport::CACHE_POOL_COUNT; ++i)
+        {
+            mCapacity[i].store(0, std::memory_order_relaxed);
+            mBaseHits[i] = mBaseMisses[i] = mBaseLocalHits[i] = 0;
+            mBaseRunHits[i] = mBaseRunMisses[i] = 0;
+        }
+    }
+    
+    ~LLArabicTextCache()
+    {
+        // No readers are left at this point
+        LLArabicEpochDomain::instance().reclaimAll();
+        for (Shard& shard : mShards)
+        {
+            for (Slab* slab : shard.mSlabs)
+            {
+                destroySlab(slab);
+            }
+            delete shard.mTable.load(std::memory_order_relaxed);
+        }
+    }
+    
+    /**
+     * Pipeline stage a cached result belongs to. The stage is part of the
+     * key, so one input can have a bidi-only and a fully processed entry.
+     * STAGE_RUN holds the glyphs of one run of a line, keyed by the run and
+     * its joining context; its hits and misses are counted on their own.
+     */
+    enum EStage
+    {
+        STAGE_BIDI = 0,
+        STAGE_FULL,
+        STAGE_RUN
+    };
+    
+    /**
+     * Hash of a key's text, before the stage is mixed in. Computed
+     * incrementally by LLArabicTextAnalysis while it walks the text.
+     */
+    static const uint64_t HASH_SEED = 0xcbf29ce484222325ULL;
+    
+    static uint64_t hashStep(uint64_t hash, wchar_t ch)
+    {
+        return (hash ^ static_cast<uint32_t>(ch)) * 0x100000001b3ULL;
+    }
+    
+    static uint64_t hashText(std::wstring_view text)
+    {
+        uint64_t hash = HASH_SEED;
+        for (wchar_t ch : text)
+        {
+            hash = hashStep(hash, ch);
+        }
+        return hash;
+    }
+    
+    /**
+     * Lock-free lookup. The caller must hold an LLArabicEpochGuard (or
+     * another epoch pin) for as long as it uses value.
+     * @param text_hash hashText(key)
+     */
+    bool lookup(std::wstring_view key, uint64_t text_hash, EStage stage, ECachePool pool,
+                std::wstring_view& value, bool count_miss = true)
+    {
+        uint64_t hash = hashKey(text_hash, stage);
+        LLArabicThreadRecord& record = LLArabicEpochDomain::instance().threadRecord();
+        recordRead(record, hash);
+        
+        const Entry* entry = find(shardFor(hash), hash, key, stage);
+        if (entry)
+        {
+            value = std::wstring_view(entry->value(), entry->mValueLength);
+            bump(stage == STAGE_RUN ? record.mRunHits[pool] : record.mHits[pool]);
+            return true;
+        }
+        
+        if (count_miss)
+        {
+            bump(stage == STAGE_RUN ? record.mRunMisses[pool] : record.mMisses[pool]);
+        }
+        return false;
+    }
+    
+    /**
+     * Count a hit served by the calling thread's LLArabicLocalCache. It
+     * still feeds the frequency sketch, so admission sees the key as hot.
+     */
+    void countLocalHit(uint64_t text_hash, EStage stage, ECachePool pool)
+    {
+        LLArabicThreadRecord& record = LLArabicEpochDomain::instance().threadRecord();
+        recordRead(record, hashKey(text_hash, stage));
+        bump(record.mHits[pool]);
+        bump(record.mLocalHits[pool]);
+    }
+    
+    void insert(std::wstring_view key, uint64_t text_hash, EStage stage,
+                std::wstring_view value, ECachePool pool)
+    {
+        LL_ARABIC_TRACE_ZONE(zone, "cacheInsert");
+        LL_ARABIC_TRACE_LENGTH(zone, key.size());
+        uint64_t hash = hashKey(text_hash, stage);
+        Shard& shard = shardFor(hash);
+        std::lock_guard<std::mutex> lock(shard.mMutex);
+        
+        SlotTable* table = shard.mTable.load(std::memory_order_relaxed);
+        if (findSlot(table, hash, key, stage) != NOT_FOUND)
+        {
+            // Another thread got there first
+            return;
+        }
+        
+        size_t key_units = keyUnits(key);
+        size_t size = entrySize(key_units, value.size());
+        size_t capacity = shardCapacity(pool);
+        if (capacity > 0 && shard.mBytes[pool] + size > capacity)
+        {
+            size_t victim = clockVictim(shard, pool);
+            if (size > capacity ||
+                (victim != NOT_FOUND && !admit(hash, table->mSlots[victim].load(std::memory_order_relaxed)->mHash)))
+            {
+                LL_ARABIC_TRACE_CACHE(zone, "rejected");
+                shard.mRejected[pool]++;
+                return;
+            }
+            while (shard.mBytes[pool] + size > capacity)
+            {
+                if (!evictOne(shard, pool))
+                {
+                    break;
+                }
+            }
+            if (shard.mSlabBytes > 2 * liveBytes(shard) + mSlabSize.load(std::memory_order_relaxed))
+            {
+                repack(shard);
+            }
+        }
+        
+        if (shard.mUsedSlots + 1 > (table->mMask + 1) * 3 / 4)
+        {
+            table = rebuild(shard);
+        }
+        
+        Entry* entry = appendEntry(shard, size);
+        entry->mHash = hash;
+        entry->mKeyLength = static_cast<uint32_t>(key_units);
+        entry->mValueLength = static_cast<uint32_t>(value.size());
+        entry->mStage = static_cast<uint8_t>(stage);
+        entry->mPool = static_cast<uint8_t>(pool);
+        entry->mReferenced.store(0, std::memory_order_relaxed);
+        std::copy(value.begin(), value.end(), const_cast<wchar_t*>(entry->value()));
+        encodeKey(key, const_cast<char16_t*>(entry->key()));
+        
+        for (size_t i = hash & table->mMask; ; i = (i + 1) & table->mMask)
+        {
+            Entry* slot = table->mSlots[i].load(std::memory_order_relaxed);
+            if (!isLive(slot))
+            {
+                if (!slot)
+                {
+                    shard.mUsedSlots++;
+                }
+                table->mSlots[i].store(entry, std::memory_order_release);
+                break;
+            }
+        }
+        shard.mEntries[pool]++;
+        shard.mBytes[pool] += size;
+    }
+    
+    // Callers serialize setCapacity(); inserts on other threads read the
+    // budgets without a lock
+    void setCapacity(ECachePool pool, size_t capacity)
+    {
+        mCapacity[pool].store(capacity, std::memory_order_relaxed);
+        
+        // A few slabs per shard hold a full budget; unlimited caches get
+        // the largest slabs
+        size_t total = 0;
+        bool unlimited = false;
+        for (const std::atomic<size_t>& budget : mCapacity)
+        {
+            size_t c = budget.load(std::memory_order_relaxed);
+            total += c;
+            unlimited = unlimited || c == 0;
+        }
+        size_t slab_size = unlimited ? MAX_SLAB_SIZE : total / SHARD_COUNT / 4;
+        mSlabSize.store(std::min(std::max(slab_size, MIN_SLAB_SIZE), MAX_SLAB_SIZE),
+                        std::memory_order_relaxed);
+        
+        size_t per_shard = shardCapacity(pool);
+        for (Shard& shard : mShards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mMutex);
+            while (per_shard > 0 && shard.mBytes[pool] > per_shard)
+            {
+                if (!evictOne(shard, pool))
+                {
+                    break;
+                }
+            }
+        }
+        
+        // The sketch is sized for the entries a full cache holds
+        std::lock_guard<std::mutex> lock(mSketchMutex);
+        mSketch.resize(total / TYPICAL_ENTRY_SIZE);
+    }
+    
+    void clear()
+    {
+        LLArabicEpochDomain& domain = LLArabicEpochDomain::instance();
+        for (Shard& shard : mShards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mMutex);
+            SlotTable* table = shard.mTable.load(std::memory_order_relaxed);
+            shard.mTable.store(new SlotTable(MIN_SLOTS), std::memory_order_release);
+            for (Slab* slab : shard.mSlabs)
+            {
+                domain.retire(slab, &destroySlab, slab->mSize);
+            }
+            domain.retire(table, &destroyTable);
+            shard.mSlabs.clear();
+            shard.mSlabBytes = 0;
+            shard.mUsedSlots = 0;
+            shard.mHand = 0;
+            for (int i = 0; i < LLArabicSupport::CACHE_POOL_COUNT; ++i)
+            {
+                shard.mEntries[i] = shard.mBytes[i] = shard.mEvictions[i] = shard.mRejected[i] = 0;
+            }
+        }
+        
+        // Counters are owned by their threads; remember where they stood
+        LLArabicSupport::CacheStats stats;
+        sumThreadCounters(stats);
+        for (int i = 0; i < LLArabicSupport::CACHE_POOL_COUNT; ++i)
+        {
+            mBaseHits[i] = stats.mHits[i];
+            mBaseMisses[i] = stats.mMisses[i];
+            mBaseLocalHits[i] = stats.mLocalHits[i];
+            mBaseRunHits[i] = stats.mRunHits[i];
+            mBaseRunMisses[i] = stats.mRunMisses[i];
+        }
+        
+        std::lock_guard<std::mutex> lock(mSketchMutex);
+        mSketch.clear();
+    }
+    
+    /**
+     * Give memory back: drop the colder half of every pool, repack what
+     * is left and free retired slabs right away
+     */
+    void shrink()
+    {
+        LL_ARABIC_TRACE_ZONE(zone, "cacheShrink");
+        for (Shard& shard : mShards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mMutex);
+            for (int i = 0; i < LLArabicSupport::CACHE_POOL_COUNT; ++i)
+            {
+                ECachePool pool = static_cast<ECachePool>(i);
+                size_t target = shard.mBytes[pool] / 2;
+                while (shard.mBytes[pool] > target)
+                {
+                    if (!evictOne(shard, pool))
+                    {
+                        break;
+                    }
+                }
+            }
+            repack(shard);
+        }
+        LLArabicEpochDomain::instance().collect();
+    }
+    
+    void getStats(LLArabicSupport::CacheStats& stats) const
+    {
+        sumThreadCounters(stats);
+        stats.mSlabBytes = 0;
+        for (int i = 0; i < LLArabicSupport::CACHE_POOL_COUNT; ++i)
+        {
+            stats.mHits[i] -= mBaseHits[i];
+            stats.mMisses[i] -= mBaseMisses[i];
+            stats.mLocalHits[i] -= mBaseLocalHits[i];
+            stats.mRunHits[i] -= mBaseRunHits[i];
+            stats.mRunMisses[i] -= mBaseRunMisses[i];
+            stats.mCapacity[i] = mCapacity[i].load(std::memory_order_relaxed);
+            stats.mEntries[i] = stats.mBytes[i] = stats.mEvictions[i] = stats.mRejected[i] = 0;
+        }
+        
+        for (const Shard& shard : mShards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mMutex);
+            stats.mSlabBytes += shard.mSlabBytes;
+            for (int i = 0; i < LLArabicSupport::CACHE_POOL_COUNT; ++i)
+            {
+                stats.mEntries[i] += shard.mEntries[i];
+                stats.mBytes[i] += shard.mBytes[i];
+                stats.mEvictions[i] += shard.mEvictions[i];
+                stats.mRejected[i] += shard.mRejected[i];
+            }
+        }
+    }
+    
+private:
+    static const size_t SHARD_COUNT = 16;
+    static const size_t MIN_SLOTS = 16;
+    static const size_t NOT_FOUND = ~size_t(0);
+    static constexpr size_t MIN_SLAB_SIZE = 1024;
+    static constexpr size_t MAX_SLAB_SIZE = 64 * 1024;
+    static const size_t TYPICAL_ENTRY_SIZE = 128;   // Header and a short line
+    
+    struct Slab;
+    
+    /**
+     * Record in a slab, immutable once published except for the CLOCK
+     * reference bit. The value (wchar_t) and the key (UTF-16) follow the
+     * header.
+     */
+    struct Entry
+    {
+        uint64_t mHash;
+        Slab* mSlab;
+        uint32_t mKeyLength;        // UTF-16 code units
+        uint32_t mValueLength;
+        uint8_t mStage;
+        uint8_t mPool;
+        std::atomic<uint8_t> mReferenced;
+        
+        const wchar_t* value() const { return reinterpret_cast<const wchar_t*>(this + 1); }
+        const char16_t* key() const { return reinterpret_cast<const char16_t*>(value() + mValueLength); }
+    };
+    
+    /**
+     * Append-only block of records, freed as a whole
+     */
+    struct Slab
+    {
+        size_t mSize;               // Record space after the header
+        size_t mUsed;
+        size_t mLive;               // Bytes of records still in the table
+        
+        char* data() { return reinterpret_cast<char*>(this + 1); }
+    };
+    
+    struct SlotTable
+    {
+        size_t mMask;
+        std::unique_ptr<std::atomic<Entry*>[]> mSlots;
+        
+        explicit SlotTable(size_t slots)
+            : mMask(slots - 1)
+            , mSlots(new std::atomic<Entry*>[slots])
+        {
+            for (size_t i = 0; i < slots; ++i)
+            {
+                mSlots[i].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+    };
+    
+    struct alignas(CACHE_LINE_SIZE) Shard
+    {
+        std::atomic<SlotTable*> mTable;
+        
+        // Writer state, guarded by mMutex
+        mutable std::mutex mMutex;
+        std::vector<Slab*> mSlabs;          // The last one is appended to
+        size_t mSlabBytes = 0;
+        size_t mUsedSlots = 0;              // Live entries plus tombstones
+        size_t mHand = 0;                   // CLOCK hand
+        size_t mEntries[LLArabicSupport::CACHE_POOL_COUNT] = {};
+        size_t mBytes[LLArabicSupport::CACHE_POOL_COUNT] = {};
+        size_t mEvictions[LLArabicSupport::CACHE_POOL_COUNT] = {};
+        size_t mRejected[LLArabicSupport::CACHE_POOL_COUNT] = {};
+    };
+    
+    static Entry* tombstone()
+    {
+        return reinterpret_cast<Entry*>(uintptr_t(1));
+    }
+    
+    static bool isLive(const Entry* entry)
+    {
+        return entry && entry != tombstone();
+    }
+    
+    static uint64_t hashKey(uint64_t text_hash, EStage stage)
+    {
+        // Finalize so that shard and slot bits are both well mixed
+        uint64_t h = text_hash;
+        h ^= static_cast<uint64_t>(stage) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+    
+    static void bump(std::atomic<size_t>& counter)
+    {
+        // Single writer, so a plain load/store is enough
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    
+    // Keys are stored as UTF-16, which is what wchar_t already holds on
+    // Windows; elsewhere characters outside the BMP become surrogate pairs
+    static size_t keyUnits(std::wstring_view key)
+    {
+        size_t units = key.size();
+        for (wchar_t ch : key)
+        {
+            if (static_cast<uint32_t>(ch) > 0xFFFF)
+            {
+                ++units;
+            }
+        }
+        return units;
+    }
+    
+    static void encodeKey(std::wstring_view key, char16_t* out)
+    {
+        for (wchar_t ch : key)
+        {
+            uint32_t cp = static_cast<uint32_t>(ch);
+            if (cp > 0xFFFF)
+            {
+                cp -= 0x10000;
+                *out++ = static_cast<char16_t>(0xD800 + (cp >> 10));
+                *out++ = static_cast<char16_t>(0xDC00 + (cp & 0x3FF));
+            }
+            else
+            {
+                *out++ = static_cast<char16_t>(cp);
+            }
+        }
+    }
+    
+    static bool keyEquals(const Entry* entry, std::wstring_view key)
+    {
+        if (entry->mKeyLength < key.size())
+        {
+            return false;
+        }
+        
+        const char16_t* stored = entry->key();
+        const char16_t* end = stored + entry->mKeyLength;
+        for (wchar_t ch : key)
+        {
+            uint32_t cp = static_cast<uint32_t>(ch);
+            if (cp > 0xFFFF)
+            {
+                cp -= 0x10000;
+                if (end - stored < 2 ||
+                    stored[0] != static_cast<char16_t>(0xD800 + (cp >> 10)) ||
+                    stored[1] != static_cast<char16_t>(0xDC00 + (cp & 0x3FF)))
+                {
+                    return false;
+                }
+                stored += 2;
+            }
+            else
+            {
+                if (stored == end || *stored != static_cast<char16_t>(cp))
+                {
+                    return false;
+                }
+                ++stored;
+            }
+        }
+        return stored == end;
+    }
+    
+    static size_t entrySize(size_t key_units, size_t value_length)
+    {
+        size_t size = sizeof(Entry) + value_length * sizeof(wchar_t) + key_units * sizeof(char16_t);
+        return (size + alignof(Entry) - 1) & ~(alignof(Entry) - 1);
+    }
+    
+    static size_t entrySize(const Entry* entry)
+    {
+        return entrySize(entry->mKeyLength, entry->mValueLength);
+    }
+    
+    static Slab* createSlab(size_t size)
+    {
+        Slab* slab = new (::operator new(sizeof(Slab) + size)) Slab;
+        slab->mSize = size;
+        slab->mUsed = 0;
+        slab->mLive = 0;
+        return slab;
+    }
+    
+    static void destroySlab(void* ptr)
+    {
+        ::operator delete(ptr);
+    }
+    
+    static void destroyTable(void* ptr)
+    {
+        delete static_cast<SlotTable*>(ptr);
+    }
+    
+    Shard& shardFor(uint64_t hash)
+    {
+        return mShards[(hash >> 56) % SHARD_COUNT];
+    }
+    
+    size_t shardCapacity(ECachePool pool) const
+    {
+        return (mCapacity[pool].load(std::memory_order_relaxed) + SHARD_COUNT - 1) / SHARD_COUNT;
+    }
+    
+    static size_t liveBytes(const Shard& shard)
+    {
+        size_t live = 0;
+        for (size_t bytes : shard.mBytes)
+        {
+            live += bytes;
+        }
+        return live;
+    }
+    
+    // Reserve size bytes at the end of the shard's current slab
+    Entry* appendEntry(Shard& shard, size_t size)
+    {
+        Slab* slab = shard.mSlabs.empty() ? nullptr : shard.mSlabs.back();
+        if (!slab || slab->mSize - slab->mUsed < size)
+        {
+            slab = createSlab(std::max(mSlabSize.load(std::memory_order_relaxed), size));
+            shard.mSlabs.push_back(slab);
+            shard.mSlabBytes += slab->mSize;
+        }
+        
+        Entry* entry = new (slab->data() + slab->mUsed) Entry;
+        entry->mSlab = slab;
+        slab->mUsed += size;
+        slab->mLive += size;
+        return entry;
+    }
+    
+    // Account for a record that was unlinked from the table
+    void releaseEntry(Shard& shard, const Entry* entry)
+    {
+        size_t size = entrySize(entry);
+        shard.mEntries[entry->mPool]--;
+        shard.mBytes[entry->mPool] -= size;
+        
+        Slab* slab = entry->mSlab;
+        slab->mLive -= size;
+        if (slab->mLive == 0 && slab != shard.mSlabs.back())
+        {
+            shard.mSlabs.erase(std::find(shard.mSlabs.begin(), shard.mSlabs.end(), slab));
+            shard.mSlabBytes -= slab->mSize;
+            LLArabicEpochDomain::instance().retire(slab, &destroySlab, slab->mSize);
+        }
+    }
+    
+    // Copy every live record into fresh slabs and free the old ones;
+    // readers still looking at an old record are covered by the epoch
+    void repack(Shard& shard)
+    {
+        LL_ARABIC_TRACE_ZONE(zone, "cacheRepack");
+        std::vector<Slab*> old_slabs;
+        old_slabs.swap(shard.mSlabs);
+        shard.mSlabBytes = 0;
+        
+        SlotTable* table = shard.mTable.load(std::memory_order_relaxed);
+        for (size_t i = 0; i <= table->mMask; ++i)
+        {
+            Entry* entry = table->mSlots[i].load(std::memory_order_relaxed);
+            if (!isLive(entry))
+            {
+                continue;
+            }
+            
+            size_t size = entrySize(entry);
+            Entry* copy = appendEntry(shard, size);
+            copy->mHash = entry->mHash;
+            copy->mKeyLength = entry->mKeyLength;
+            copy->mValueLength = entry->mValueLength;
+            copy->mStage = entry->mStage;
+            copy->mPool = entry->mPool;
+            copy->mReferenced.store(entry->mReferenced.load(std::memory_order_relaxed),
+                                    std::memory_order_relaxed);
+            std::memcpy(const_cast<wchar_t*>(copy->value()), entry->value(), size - sizeof(Entry));
+            table->mSlots[i].store(copy, std::memory_order_release);
+        }
+        
+        LLArabicEpochDomain& domain = LLArabicEpochDomain::instance();
+        for (Slab* slab : old_slabs)
+        {
+            domain.retire(slab, &destroySlab, slab->mSize);
+        }
+    }
+    
+    // Lock-free probe; caller holds an epoch guard
+    const Entry* find(const Shard& shard, uint64_t hash, std::wstring_view key, EStage stage) const
+    {
+        const SlotTable* table = shard.mTable.load(std::memory_order_acquire);
+        for (size_t i = hash & table->mMask, n = 0; n <= table->mMask;
+             i = (i + 1) & table->mMask, ++n)
+        {
+            Entry* entry = table->mSlots[i].load(std::memory_order_acquire);
+            if (!entry)
+            {
+                break;
+            }
+            if (entry != tombstone() && entry->mHash == hash && entry->mStage == stage &&
+                keyEquals(entry, key))
+            {
+                // Only write the shared line when the bit actually changes
+                if (!entry->mReferenced.load(std::memory_order_relaxed))
+                {
+                    entry->mReferenced.store(1, std::memory_order_relaxed);
+                }
+                return entry;
+            }
+        }
+        return nullptr;
+    }
+    
+    // Writer-side probe; caller holds the shard mutex
+    static size_t findSlot(const SlotTable* table, uint64_t hash, std::wstring_view key, EStage stage)
+    {
+        for (size_t i = hash & table->mMask, n = 0; n <= table->mMask;
+             i = (i + 1) & table->mMask, ++n)
+        {
+            Entry* entry = table->mSlots[i].load(std::memory_order_relaxed);
+            if (!entry)
+            {
+                break;
+            }
+            if (entry != tombstone() && entry->mHash == hash && entry->mStage == stage &&
+                keyEquals(entry, key))
+            {
+                return i;
+            }
+        }
+        return NOT_FOUND;
+    }
+    
+    // Advance the CLOCK hand to the next unreferenced entry of pool
+    size_t clockVictim(Shard& shard, ECachePool pool)
+    {
+        SlotTable* table = shard.mTable.load(std::memory_order_relaxed);
+        size_t slots = table->mMask + 1;
+        for (size_t n = 0; n < 2 * slots; ++n)
+        {
+            size_t i = shard.mHand;
+            Entry* entry = table->mSlots[i].load(std::memory_order_relaxed);
+            if (isLive(entry) && entry->mPool == pool)
+            {
+                if (!entry->mReferenced.load(std::memory_order_relaxed))
+                {
+                    return i;
+                }
+                entry->mReferenced.store(0, std::memory_order_relaxed);
+            }
+            shard.mHand = (i + 1) & table->mMask;
+        }
+        return NOT_FOUND;
+    }
+    
+    bool evictOne(Shard& shard, ECachePool pool)
+    {
+        LL_ARABIC_TRACE_ZONE(zone, "cacheEvict");
+        size_t victim = clockVictim(shard, pool);
+        if (victim == NOT_FOUND)
+        {
+            return false;
+        }
+        
+        SlotTable* table = shard.mTable.load(std::memory_order_relaxed);
+        Entry* entry = table->mSlots[victim].load(std::memory_order_relaxed);
+        table->mSlots[victim].store(tombstone(), std::memory_order_release);
+        releaseEntry(shard, entry);
+        shard.mEvictions[pool]++;
+        return true;
+    }
+    
+    // Replace the shard's table with a fresh one without tombstones
+    SlotTable* rebuild(Shard& shard)
+    {
+        LL_ARABIC_TRACE_ZONE(zone, "cacheRebuild");
+        SlotTable* old_table = shard.mTable.load(std::memory_order_relaxed);
+        size_t live = 0;
+        for (size_t count : shard.mEntries)
+        {
+            live += count;
+        }
+        
+        size_t slots = MIN_SLOTS;
+        while (slots < (live + 1) * 2)
+        {
+            slots <<= 1;
+        }
+        
+        SlotTable* table = new SlotTable(slots);
+        for (size_t i = 0; i <= old_table->mMask; ++i)
+        {
+            Entry* entry = old_table->mSlots[i].load(std::memory_order_relaxed);
+            if (!isLive(entry))
+            {
+                continue;
+            }
+            size_t j = entry->mHash & table->mMask;
+            while (table->mSlots[j].load(std::memory_order_relaxed))
+            {
+                j = (j + 1) & table->mMask;
+            }
+            table->mSlots[j].store(entry, std::memory_order_relaxed);
+        }
+        
+        shard.mTable.store(table, std::memory_order_release);
+        shard.mUsedSlots = live;
+        shard.mHand = 0;
+        LLArabicEpochDomain::instance().retire(old_table, &destroyTable);
+        return table;
+    }
+    
+    void recordRead(LLArabicThreadRecord& record, uint64_t hash)
+    {
+        record.mReadBuffer[record.mReadCount++] = hash;
+        if (record.mReadCount == READ_BUFFER_SIZE)
+        {
+            // Lossy by design: if the sketch is busy, drop the samples
+            // rather than make a reader wait
+            if (mSketchMutex.try_lock())
+            {
+                drainReads(record);
+                mSketchMutex.unlock();
+            }
+            record.mReadCount = 0;
+        }
+    }
+    
+    // Called with mSketchMutex held
+    void drainReads(LLArabicThreadRecord& record)
+    {
+        for (size_t i = 0; i < record.mReadCount; ++i)
+        {
+            mSketch.increment(static_cast<size_t>(record.mReadBuffer[i]));
+        }
+        record.mReadCount = 0;
+    }
+    
+    // TinyLFU admission: the candidate has to be more popular than its victim
+    bool admit(uint64_t candidate, uint64_t victim)
+    {
+        std::lock_guard<std::mutex> lock(mSketchMutex);
+        drainReads(LLArabicEpochDomain::instance().threadRecord());
+        return mSketch.frequency(static_cast<size_t>(candidate)) >
+               mSketch.frequency(static_cast<size_t>(victim));
+    }
+    
+    void sumThreadCounters(LLArabicSupport::CacheStats& stats) const
+    {
+        for (int i = 0; i < LLArabicSupport::CACHE_POOL_COUNT; ++i)
+        {
+            stats.mHits[i] = stats.mMisses[i] = stats.mLocalHits[i] = 0;
+            stats.mRunHits[i] = stats.mRunMisses[i] = 0;
+        }
+        for (LLArabicThreadRecord* record = LLArabicEpochDomain::instance().firstRecord();
+             record; record = record->mNext)
+        {
+            for (int i = 0; i < LLArabicSupport::CACHE_POOL_COUNT; ++i)
+            {
+                stats.mHits[i] += record->mHits[i].load(std::memory_order_relaxed);
+                stats.mMisses[i] += record->mMisses[i].load(std::memory_order_relaxed);
+                stats.mLocalHits[i] += record->mLocalHits[i].load(std::memory_order_relaxed);
+                stats.mRunHits[i] += record->mRunHits[i].load(std::memory_order_relaxed);
+                stats.mRunMisses[i] += record->mRunMisses[i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    Shard mShards[SHARD_COUNT];
+    std::atomic<size_t> mCapacity[LLArabicSupport::CACHE_POOL_COUNT];  // Bytes
+    std::atomic<size_t> mSlabSize;
+    size_t mBaseHits[LLArabicSupport::CACHE_POOL_COUNT];
+    size_t mBaseMisses[LLArabicSupport::CACHE_POOL_COUNT];
+    size_t mBaseLocalHits[LLArabicSupport::CACHE_POOL_COUNT];
+    size_t mBaseRunHits[LLArabicSupport::CACHE_POOL_COUNT];
+    size_t mBaseRunMisses[LLArabicSupport::CACHE_POOL_COUNT];
+    
+    std::mutex mSketchMutex;
+    LLArabicFrequencySketch mSketch;
+};
+
+//-----------------------------------------------------------------------------
+// LLArabicLocalCache
+//
+// Small direct-mapped cache of final results in front of the shared cache,
+// one per thread. A thread that keeps drawing the same strings (its chat
+// channel, the nameplates it handles) is served from memory no other thread
+// touches. Only short strings are kept. A global generation counter, bumped
+// when the font or the cache settings change, invalidates every thread's
+// copies at once.
+//-----------------------------------------------------------------------------
+
+class LLArabicLocalCache
+{
+public:
+    // The calling thread's cache
+    static LLArabicLocalCache& instance()
+    {
+        static thread_local LLArabicLocalCache sInstance;
+        return sInstance;
+    }
+    
+    static void invalidateAll()
+    {
+        generation().fetch_add(1, std::memory_order_release);
+    }
+    
+    // value points into this thread's cache until its next insert()
+    bool lookup(uint64_t hash, std::wstring_view key, std::wstring_view& value) const
+    {
+        const Slot& slot = mSlots[slotIndex(hash)];
+        if (slot.mHash != hash ||
+            slot.mGeneration != generation().load(std::memory_order_acquire) ||
+            std::wstring_view(slot.mChars, slot.mKeyLength) != key)
+        {
+            return false;
+        }
+        value = std::wstring_view(slot.mChars + slot.mKeyLength, slot.mValueLength);
+        return true;
+    }
+    
+    void insert(uint64_t hash, std::wstring_view key, std::wstring_view value)
+    {
+        if (key.size() + value.size() > SLOT_CHARS)
+        {
+            return;
+        }
+        
+        Slot& slot = mSlots[slotIndex(hash)];
+        slot.mHash = hash;
+        slot.mGeneration = generation().load(std::memory_order_acquire);
+        slot.mKeyLength = static_cast<uint16_t>(key.size());
+        slot.mValueLength = static_cast<uint16_t>(value.size());
+        std::copy(value.begin(), value.end(),
+                  std::copy(key.begin(), key.end(), slot.mChars));
+    }
+    
+private:
+    static const int SLOT_BITS = 6;
+    static const size_t SLOT_COUNT = size_t(1) << SLOT_BITS;
+    static const size_t SLOT_CHARS = 96;    // Key and value together
+    
+    struct Slot
+    {
+        uint64_t mHash;
+        uint32_t mGeneration;               // 0 = empty
+        uint16_t mKeyLength;
+        uint16_t mValueLength;
+        wchar_t mChars[SLOT_CHARS];
+    };
+    
+    LLArabicLocalCache()
+        : mSlots(new Slot[SLOT_COUNT]())
+    {
+    }
+    
+    static size_t slotIndex(uint64_t hash)
+    {
+        // Text hashes are not finalized; take the well-mixed top bits
+        return static_cast<size_t>((hash * 0x9e3779b97f4a7c15ULL) >> (64 - SLOT_BITS));
+    }
+    
+    static std::atomic<uint32_t>& generation()
+    {
+        static std::atomic<uint32_t> sGeneration(1);
+        return sGeneration;
+    }
+    
+    std::unique_ptr<Slot[]> mSlots;
+};
+
+//-----------------------------------------------------------------------------
+// LLArabicSharedCache
+//
+// Final results shared by the viewer instances running on one machine (alts,
+// bots) through a POSIX shared memory segment, so a group chat line or region
+// name is shaped once between them. Build with LL_ARABIC_SHARED_CACHE.
+//
+// The segment is a header and a power-of-two table of fixed-size slots: no
+// pointers, no locks. A slot's sequence number is odd while a writer fills
+// it. Readers copy an entry out and treat a sequence that changed meanwhile
+// as a miss; writers claim a slot with a CAS and skip it if another writer
+// holds it, so no process ever waits for another. Entries are keyed by text
+// hash and font identity.
+//
+// Other processes may crash at any point, or run a different build, and
+// nothing they leave behind may take this one down. The header is checked
+// before the segment is used and its geometry is never read again, and every
+// entry carries a checksum that is verified before it is returned. A segment
+// that fails the checks (or is still being set up by its creator) is left
+// alone and the private cache is used on its own. A writer that dies
+// mid-write leaves its slot claimed: that slot is lost, not the table.
+//-----------------------------------------------------------------------------
+
+#if LL_ARABIC_SHARED_CACHE
+
+class LLArabicSharedCache
+{
+public:
+    static constexpr size_t SLOT_CHARS = 112;   // Key and value together
+    
+    // Attach to the segment, creating it if it does not exist; nullptr if
+    // it cannot be opened or is not a valid segment
+    static LLArabicSharedCache* open(const std::string& name, size_t max_size)
+    {
+        size_t slot_bits = 0;
+        while (HEADER_SIZE + (sizeof(Slot) << (slot_bits + 1)) <= max_size)
+        {
+            ++slot_bits;
+        }
+        if ((size_t(1) << slot_bits) < PROBE_COUNT)
+        {
+            return nullptr;
+        }
+        
+        bool created = true;
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && errno == EEXIST)
+        {
+            created = false;
+            fd = shm_open(name.c_str(), O_RDWR, 0600);
+        }
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+        
+        size_t mapped_size = HEADER_SIZE + (sizeof(Slot) << slot_bits);
+        struct stat info;
+        bool sized = created ? ftruncate(fd, static_cast<off_t>(mapped_size)) == 0
+                             : fstat(fd, &info) == 0 && info.st_size >= static_cast<off_t>(HEADER_SIZE);
+        if (sized && !created)
+        {
+            mapped_size = static_cast<size_t>(info.st_size);
+        }
+        void* memory = sized ? mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                             : MAP_FAILED;
+        close(fd);
+        if (memory == MAP_FAILED)
+        {
+            if (created)
+            {
+                shm_unlink(name.c_str());
+            }
+            return nullptr;
+        }
+        
+        // A new segment is zero-filled: every slot is empty with sequence 0
+        Header* header = static_cast<Header*>(memory);
+        if (created)
+        {
+            header->mVersion = VERSION;
+            header->mCharSize = sizeof(wchar_t);
+            header->mSlotSize = sizeof(Slot);
+            header->mSlotCount = size_t(1) << slot_bits;
+            header->mMagic.store(MAGIC, std::memory_order_release);
+        }
+        else if (!isValid(*header, mapped_size, slot_bits))
+        {
+            munmap(memory, mapped_size);
+            return nullptr;
+        }
+        
+        return new LLArabicSharedCache(memory, mapped_size, slot_bits);
+    }
+    
+    static void destroy(void* ptr)
+    {
+        delete static_cast<LLArabicSharedCache*>(ptr);
+    }
+    
+    ~LLArabicSharedCache()
+    {
+        munmap(mMemory, mMappedSize);
+    }
+    
+    // value must hold SLOT_CHARS characters
+    bool lookup(uint64_t hash, uint64_t font, std::wstring_view key, wchar_t* value, size_t& length)
+    {
+        if (key.size() >= SLOT_CHARS)
+        {
+            return false;
+        }
+        
+        size_t index = slotIndex(hash);
+        for (size_t probe = 0; probe < PROBE_COUNT; ++probe)
+        {
+            Slot& slot = mSlots[(index + probe) & mSlotMask];
+            uint64_t sequence = slot.mSequence.load(std::memory_order_acquire);
+            if ((sequence & 1) || slot.mEntry.mHash != hash || slot.mEntry.mFont != font)
+            {
+                continue;
+            }
+            
+            // Copy the entry out, then make sure no writer got in meanwhile
+            Entry entry;
+            std::memcpy(&entry, &slot.mEntry, sizeof(Entry));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.mSequence.load(std::memory_order_relaxed) != sequence)
+            {
+                continue;
+            }
+            
+            if (size_t(entry.mKeyLength) + entry.mValueLength > SLOT_CHARS ||
+                entry.mChecksum != checksum(entry))
+            {
+                mCorrupt.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            if (std::wstring_view(entry.mChars, entry.mKeyLength) == key)
+            {
+                std::copy_n(entry.mChars + entry.mKeyLength, entry.mValueLength, value);
+                length = entry.mValueLength;
+                mHits.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        
+        mMisses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    
+    void insert(uint64_t hash, uint64_t font, std::wstring_view key, std::wstring_view value)
+    {
+        if (key.size() + value.size() > SLOT_CHARS)
+        {
+            return;
+        }
+        
+        // The slot that holds this key already, else an empty one, else
+        // one picked by the hash
+        size_t index = slotIndex(hash);
+        Slot* target = &mSlots[(index + (hash >> 32) % PROBE_COUNT) & mSlotMask];
+        bool found_empty = false;
+        for (size_t probe = 0; probe < PROBE_COUNT; ++probe)
+        {
+            Slot& slot = mSlots[(index + probe) & mSlotMask];
+            if (slot.mEntry.mHash == hash && slot.mEntry.mFont == font)
+            {
+                target = &slot;
+                break;
+            }
+            if (!found_empty && slot.mEntry.mKeyLength == 0)
+            {
+                target = &slot;
+                found_empty = true;
+            }
+        }
+        
+        uint64_t sequence = target->mSequence.load(std::memory_order_relaxed);
+        if ((sequence & 1) ||
+            !target->mSequence.compare_exchange_strong(sequence, sequence + 1,
+                                                       std::memory_order_acquire,
+                                                       std::memory_order_relaxed))
+        {
+            return;
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        
+        Entry& entry = target->mEntry;
+        entry.mHash = hash;
+        entry.mFont = font;
+        entry.mKeyLength = static_cast<uint32_t>(key.size());
+        entry.mValueLength = static_cast<uint32_t>(value.size());
+        std::copy(value.begin(), value.end(),
+                  std::copy(key.begin(), key.end(), entry.mChars));
+        entry.mChecksum = checksum(entry);
+        
+        target->mSequence.store(sequence + 2, std::memory_order_release);
+    }
+    
+    void getStats(LLArabicSupport::CacheStats& stats) const
+    {
+        stats.mSharedHits = mHits.load(std::memory_order_relaxed);
+        stats.mSharedMisses = mMisses.load(std::memory_order_relaxed);
+        stats.mSharedCorrupt = mCorrupt.load(std::memory_order_relaxed);
+    }
+    
+private:
+    static constexpr uint64_t MAGIC = 0x53454c4141524243ULL;   // "SELAARBC"
+    static constexpr uint32_t VERSION = 1;  // Bump when the layout or the pipeline's output changes
+    static constexpr size_t HEADER_SIZE = 64;
+    static constexpr size_t PROBE_COUNT = 4;
+    
+    static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                  "Shared cache slots need lock-free 64-bit atomics");
+    
+    struct Header
+    {
+        std::atomic<uint64_t> mMagic;       // Stored last by the creator
+        uint32_t mVersion;
+        uint32_t mCharSize;                 // sizeof(wchar_t)
+        uint64_t mSlotSize;
+        uint64_t mSlotCount;                // A power of two
+    };
+    
+    struct Entry
+    {
+        uint64_t mHash;                     // LLArabicTextCache::hashText(key)
+        uint64_t mFont;                     // Font identity
+        uint64_t mChecksum;
+        uint32_t mKeyLength;                // 0 = empty
+        uint32_t mValueLength;
+        wchar_t mChars[SLOT_CHARS];
+    };
+    
+    struct Slot
+    {
+        std::atomic<uint64_t> mSequence;    // Odd while a writer fills mEntry
+        Entry mEntry;
+    };
+    
+    static_assert(sizeof(Header) <= HEADER_SIZE, "Shared cache header outgrew its space");
+    
+    LLArabicSharedCache(void* memory, size_t mapped_size, size_t slot_bits)
+        : mMemory(memory)
+        , mMappedSize(mapped_size)
+        , mSlots(reinterpret_cast<Slot*>(static_cast<char*>(memory) + HEADER_SIZE))
+        , mSlotBits(slot_bits)
+        , mSlotMask((size_t(1) << slot_bits) - 1)
+        , mHits(0)
+        , mMisses(0)
+        , mCorrupt(0)
+    {
+    }
+    
+    // Reads the geometry of an existing segment into slot_bits
+    static bool isValid(const Header& header, size_t mapped_size, size_t& slot_bits)
+    {
+        if (header.mMagic.load(std::memory_order_acquire) != MAGIC ||
+            header.mVersion != VERSION ||
+            header.mCharSize != sizeof(wchar_t) ||
+            header.mSlotSize != sizeof(Slot))
+        {
+            return false;
+        }
+        
+        uint64_t slot_count = header.mSlotCount;
+        if (slot_count < PROBE_COUNT || (slot_count & (slot_count - 1)) != 0 ||
+            slot_count > (mapped_size - HEADER_SIZE) / sizeof(Slot))
+        {
+            return false;
+        }
+        
+        slot_bits = 0;
+        while ((uint64_t(1) << slot_bits) < slot_count)
+        {
+            ++slot_bits;
+        }
+        return true;
+    }
+    
+    size_t slotIndex(uint64_t hash) const
+    {
+        // Text hashes are not finalized; take the well-mixed top bits
+        return static_cast<size_t>((hash * 0x9e3779b97f4a7c15ULL) >> (64 - mSlotBits));
+    }
+    
+    // Lengths must have been checked against SLOT_CHARS
+    static uint64_t checksum(const Entry& entry)
+    {
+        uint64_t sum = LLArabicTextCache::HASH_SEED ^ entry.mHash ^ (entry.mFont * 0x9e3779b97f4a7c15ULL) ^
+                       ((uint64_t(entry.mKeyLength) << 32) | entry.mValueLength);
+        for (size_t i = 0; i < size_t(entry.mKeyLength) + entry.mValueLength; ++i)
+        {
+            sum = LLArabicTextCache::hashStep(sum, entry.mChars[i]);
+        }
+        return sum;
+    }
+    
+    void* mMemory;
+    size_t mMappedSize;
+    Slot* mSlots;
+    size_t mSlotBits;
+    size_t mSlotMask;
+    
+    // This process's lookups
+    std::atomic<size_t> mHits;
+    std::atomic<size_t> mMisses;
+    std::atomic<size_t> mCorrupt;
+};
+
+#else // LL_ARABIC_SHARED_CACHE
+
+// Without LL_ARABIC_SHARED_CACHE the segment never opens
+class LLArabicSharedCache
+{
+public:
+    static constexpr size_t SLOT_CHARS = 1;
+    
+    static LLArabicSharedCache* open(const std::string&, size_t) { return nullptr; }
+    static void destroy(void* ptr) { delete static_cast<LLArabicSharedCache*>(ptr); }
+    
+    bool lookup(uint64_t, uint64_t, std::wstring_view, wchar_t*, size_t&) { return false; }
+    void insert(uint64_t, uint64_t, std::wstring_view, std::wstring_view) {}
+    void getStats(LLArabicSupport::CacheStats& stats) const
+    {
+        stats.mSharedHits = stats.mSharedMisses = stats.mSharedCorrupt = 0;
+    }
+};
+
+#endif // LL_ARABIC_SHARED_CACHE
+
+//-----------------------------------------------------------------------------
+// LLArabicWorkerPool
+//
+// Small pool of worker threads for processing the paragraphs of large
+// documents in parallel. Started on first use, so sessions that never open a
+// long notecard never create the threads.
+//-----------------------------------------------------------------------------
+
+class LLArabicWorkerPool
+{
+public:
+    static LLArabicWorkerPool& instance()
+    {
+        static LLArabicWorkerPool sInstance;
+        return sInstance;
+    }
+    
+    /**
+     * Run fn(i) for every i in [0, count). The calling thread works on the
+     * job too and returns once every index is done.
+     */
+    void parallelFor(size_t count, const std::function<void(size_t)>& fn)
+    {
+        std::shared_ptr<Job> job = std::make_shared<Job>(count, fn);
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mJobs.push_back(job);
+        }
+        mWorkAvailable.notify_all();
+        
+        runJob(*job);
+        
+        std::unique_lock<std::mutex> lock(job->mMutex);
+        job->mDone.wait(lock, [&job]() { return job->mRemaining == 0; });
+    }
+    
+private:
+    struct Job
+    {
+        Job(size_t count, const std::function<void(size_t)>& fn)
+            : mCount(count)
+            , mFunction(fn)
+            , mNext(0)
+            , mRemaining(count)
+        {
+        }
+        
+        const size_t mCount;
+        const std::function<void(size_t)>& mFunction;
+        std::atomic<size_t> mNext;
+        
+        std::mutex mMutex;
+        std::condition_variable mDone;
+        size_t mRemaining;      // Guarded by mMutex
+    };
+    
+    LLArabicWorkerPool()
+        : mStop(false)
+    {
+        unsigned int hardware = std::thread::hardware_concurrency();
+        unsigned int workers = std::min(MAX_WORKERS, hardware > 1 ? hardware - 1 : 1);
+        for (unsigned int i = 0; i < workers; ++i)
+        {
+            mThreads.emplace_back(&LLArabicWorkerPool::workerLoop, this);
+        }
+    }
+    
+    ~LLArabicWorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mWorkAvailable.notify_all();
+        for (std::thread& thread : mThreads)
+        {
+            thread.join();
+        }
+    }
+    
+    void workerLoop()
+    {
+        while (true)
+        {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mWorkAvailable.wait(lock, [this]() { return mStop || !mJobs.empty(); });
+                if (mStop)
+                {
+                    return;
+                }
+                job = mJobs.front();
+                if (job->mNext.load() >= job->mCount)
+                {
+                    // Fully handed out; let the next job through
+                    mJobs.pop_front();
+                    continue;
+                }
+            }
+            runJob(*job);
+        }
+    }
+    
+    static void runJob(Job& job)
+    {
+        size_t finished = 0;
+        for (size_t i = job.mNext++; i < job.mCount; i = job.mNext++)
+        {
+            job.mFunction(i);
+            ++finished;
+        }
+        
+        if (finished > 0)
+        {
+            std::lock_guard<std::mutex> lock(job.mMutex);
+            job.mRemaining -= finished;
+            if (job.mRemaining == 0)
+            {
+                job.mDone.notify_all();
+            }
+        }
+    }
+    
+    static constexpr unsigned int MAX_WORKERS = 7;
+    
+    std::mutex mMutex;
+    std::condition_variable mWorkAvailable;
+    std::deque<std::shared_ptr<Job>> mJobs;
+    std::vector<std::thread> mThreads;
+    bool mStop;
+};
+
+//-----------------------------------------------------------------------------
+// LLArabicSupport implementation
+//-----------------------------------------------------------------------------
+
+namespace
+{
+    // Text up to this length is processed without touching the heap
+    const size_t SMALL_TEXT_LENGTH = 256;
+    
+    // Documents from this length on have their paragraphs processed in parallel
+    const size_t PARALLEL_DOCUMENT_LENGTH = 4096;
+    
+    // Paragraph separators (bidi class B)
+    inline bool isParagraphSeparator(wchar_t ch)
+    {
+        return ch == L'\n' || ch == L'\r' ||
+               (ch >= 0x001C && ch <= 0x001E) ||
+               ch == 0x0085 || ch == 0x2029;
+    }
+    
+    // Lines may break after these. No-break spaces (U+00A0, U+2007,
+    // U+202F) keep the words around them together.
+    inline bool isBreakSpace(wchar_t ch)
+    {
+        return ch == L' ' || ch == L'\t' || ch == 0x1680 ||
+               (ch >= 0x2000 && ch <= 0x200A && ch != 0x2007) ||
+               ch == 0x205F || ch == 0x3000;
+    }
+    
+    struct LLParagraph
+    {
+        size_t mStart;
+        size_t mLength;
+        size_t mSeparatorLength;    // 0 for the last paragraph, 2 for CR LF
+    };
+    
+    // The paragraph that starts at start; the last one has no separator
+    LLParagraph findParagraph(std::wstring_view text, size_t start)
+    {
+        for (size_t i = start; i < text.size(); ++i)
+        {
+            if (isParagraphSeparator(text[i]))
+            {
+                size_t separator = (text[i] == L'\r' && i + 1 < text.size() &&
+                                    text[i + 1] == L'\n') ? 2 : 1;
+                return LLParagraph{ start, i - start, separator };
+            }
+        }
+        return LLParagraph{ start, text.size() - start, 0 };
+    }
+    
+    void splitParagraphs(std::wstring_view text, std::vector<LLParagraph>& paragraphs)
+    {
+        size_t start = 0;
+        while (true)
+        {
+            LLParagraph paragraph = findParagraph(text, start);
+            paragraphs.push_back(paragraph);
+            if (paragraph.mSeparatorLength == 0)
+            {
+                break;
+            }
+            start = paragraph.mStart + paragraph.mLength + paragraph.mSeparatorLength;
+        }
+    }
+    
+    inline bool isArabicCodepoint(wchar_t ch)
+    {
+        // Unicode ranges for Arabic script
+        return (ch >= 0x0600 && ch <= 0x06FF) ||  // Arabic
+               (ch >= 0x0750 && ch <= 0x077F) ||  // Arabic Supplement
+               (ch >= 0x08A0 && ch <= 0x08FF) ||  // Arabic Extended-A
+               (ch >= 0xFB50 && ch <= 0xFDFF) ||  // Arabic Presentation Forms-A
+               (ch >= 0xFE70 && ch <= 0xFEFF);    // Arabic Presentation Forms-B
+    }
+    
+    // A non-empty regular file this process can read
+    bool isReadableFile(const std::string& path)
+    {
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0 || (info.st_mode & S_IFMT) != S_IFREG ||
+            info.st_size == 0)
+        {
+            return false;
+        }
+#ifdef _WIN32
+        return _access(path.c_str(), 4) == 0;
+#else
+        return access(path.c_str(), R_OK) == 0;
+#endif
+    }
+    
+    inline bool isPresentationForm(wchar_t ch)
+    {
+        return (ch >= 0xFB50 && ch <= 0xFDFF) || (ch >= 0xFE70 && ch <= 0xFEFC);
+    }
+    
+    // Lines are shaped in runs of spaces, of Arabic and of everything else
+    enum EShapingRun
+    {
+        SHAPING_RUN_SPACE = 0,
+        SHAPING_RUN_ARABIC,
+        SHAPING_RUN_OTHER
+    };
+    
+    inline EShapingRun shapingRunType(wchar_t ch)
+    {
+        return isBreakSpace(ch) ? SHAPING_RUN_SPACE :
+               isArabicCodepoint(ch) ? SHAPING_RUN_ARABIC : SHAPING_RUN_OTHER;
+    }
+    
+    // Characters that can change the form of a letter next to them: Arabic,
+    // the zero width joiner and the other joining scripts (Syriac, N'Ko,
+    // Mongolian). Spaces and everything else break joining.
+    inline bool isJoiningContext(wchar_t ch)
+    {
+        return isArabicCodepoint(ch) || ch == 0x200D ||
+               (ch >= 0x0700 && ch <= 0x07FF) || (ch >= 0x1800 && ch <= 0x18AF);
+    }
+    
+    /**
+     * Scratch array that lives on the stack for short text and falls back
+     * to the heap for long text (notecards, profiles)
+     */
+    template <typename T, size_t N = SMALL_TEXT_LENGTH>
+    class LLScratchBuffer
+    {
+    public:
+        LLScratchBuffer() {}
+        
+        explicit LLScratchBuffer(size_t size)
+        {
+            allocate(size);
+        }
+        
+        // Make room for size elements; contents are not kept
+        void allocate(size_t size)
+        {
+            if (size > N)
+            {
+                mHeap.reset(new T[size]);
+            }
+        }
+        
+        T* data() { return mHeap ? mHeap.get() : mInline; }
+        const T* data() const { return mHeap ? mHeap.get() : mInline; }
+        T& operator[](size_t i) { return data()[i]; }
+        
+    private:
+        LLScratchBuffer(const LLScratchBuffer&) = delete;
+        LLScratchBuffer& operator=(const LLScratchBuffer&) = delete;
+        
+        T mInline[N];
+        std::unique_ptr<T[]> mHeap;
+    };
+    
+    // HarfBuzz buffers are not thread-safe, so every thread shapes into
+    // its own buffer
+    struct LLShapingBufferHolder
+    {
+        hb_buffer_t* mBuffer = nullptr;
+        ~LLShapingBufferHolder()
+        {
+            if (mBuffer)
+            {
+                hb_buffer_destroy(mBuffer);
+            }
+        }
+    };
+    
+    hb_buffer_t* getShapingBuffer()
+    {
+        static thread_local LLShapingBufferHolder sHolder;
+        if (!sHolder.mBuffer)
+        {
+            hb_buffer_t* buffer = hb_buffer_create();
+            if (!hb_buffer_allocation_successful(buffer))
+            {
+                hb_buffer_destroy(buffer);
+                return nullptr;
+            }
+            sHolder.mBuffer = buffer;
+        }
+        return sHolder.mBuffer;
+    }
+    
+    // The pipeline shapes everything as right-to-left Arabic
+    void shapeRightToLeft(hb_font_t* font, hb_buffer_t* buffer)
+    {
+        hb_buffer_set_direction(buffer, HB_DIRECTION_RTL);
+        hb_buffer_set_script(buffer, HB_SCRIPT_ARABIC);
+        hb_buffer_set_language(buffer, hb_language_from_string("ar", -1));
+        
+        // Guess segment properties if not set
+        hb_buffer_guess_segment_properties(buffer);
+        
+        LL_ARABIC_TRACE_ZONE(zone, "hb_shape");
+        LL_ARABIC_TRACE_LENGTH(zone, hb_buffer_get_length(buffer));
+        hb_shape(font, buffer, nullptr, 0);
+    }
+    
+    // Writes text back to front, a whole SSE2 register at a time
+    void reverseText(const wchar_t* input, size_t length, wchar_t* output)
+    {
+        size_t i = 0;
+#if LL_ARABIC_SSE2
+        const size_t lanes = sizeof(__m128i) / sizeof(wchar_t);
+        for (; i + lanes <= length; i += lanes)
+        {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+            if constexpr (sizeof(wchar_t) == 2)
+            {
+                // Reverse each half, then swap the halves
+                chunk = _mm_shufflelo_epi16(chunk, _MM_SHUFFLE(0, 1, 2, 3));
+                chunk = _mm_shufflehi_epi16(chunk, _MM_SHUFFLE(0, 1, 2, 3));
+                chunk = _mm_shuffle_epi32(chunk, _MM_SHUFFLE(1, 0, 3, 2));
+            }
+            else
+            {
+                chunk = _mm_shuffle_epi32(chunk, _MM_SHUFFLE(0, 1, 2, 3));
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output + length - i - lanes), chunk);
+        }
+#endif
+        // The tail; on other targets the compiler vectorises this loop itself
+        for (; i < length; ++i)
+        {
+            output[length - 1 - i] = input[i];
+        }
+    }
+    
+    // Puts the marks of reversed text back after their base character, as
+    // fribidi_reorder_line() does with FRIBIDI_FLAG_REORDER_NSM. Marks at
+    // the start of the text have no base and only keep their own order.
+    // Moves the characters of the text or the entries of its visual map.
+    template <typename T>
+    void keepMarksAfterBase(const FriBidiCharType* bidi_types, size_t length, T* output)
+    {
+        for (size_t i = 0; i < length; ++i)
+        {
+            if (bidi_types[i] != FRIBIDI_TYPE_NSM)
+            {
+                continue;
+            }
+            
+            size_t start = i > 0 ? i - 1 : i;
+            while (i + 1 < length && bidi_types[i + 1] == FRIBIDI_TYPE_NSM)
+            {
+                ++i;
+            }
+            std::reverse(output + length - 1 - i, output + length - start);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// LLArabicTextAnalysis
+//
+// Everything the pipeline needs to know about a text, gathered in one walk:
+// its cache hash, what it contains (and so which stages it needs), the
+// bidi class of every character and the runs it is shaped in. Stages read this instead of scanning the
+// text again. Text is first only scanned for Arabic code points, so text
+// without Arabic costs a range check. The per-character data of long text
+// is only filled in when a stage asks for it, so cache hits never allocate.
+//-----------------------------------------------------------------------------
+
+struct LLArabicTextAnalysis
+{
+    // Without whole_text, text with no Arabic is only scanned for it and
+    // needsProcessing() is all that may be read; stages that handle any
+    // text (bidi reordering, layout) ask for the whole analysis
+    explicit LLArabicTextAnalysis(std::wstring_view text, bool whole_text = false);
+    
+    // Offset of the first Arabic code point, or the length of the text
+    static size_t findArabic(std::wstring_view text);
+    
+    // Presentation forms are reordered like any Arabic text; whether they
+    // are in logical or visual order cannot be told from the text, and
+    // only mHasJoining decides whether HarfBuzz runs
+    bool needsProcessing() const { return mHasArabic; }
+    
+    const FriBidiCharType* bidiTypes() const { classify(); return mBidiTypes.data(); }
+    
+    // Maximal runs of spaces, of Arabic and of everything else, in logical
+    // order; lines are shaped and laid out in these
+    struct ShapingRun
+    {
+        uint32_t mStart;
+        uint32_t mLength;
+        EShapingRun mType;
+        
+        bool contains(size_t offset) const { return offset >= mStart && offset < mStart + mLength; }
+    };
+    
+    const ShapingRun* shapingRuns() const { classify(); return mShapingRuns.data(); }
+    size_t shapingRunCount() const { classify(); return mShapingRunCount; }
+    
+    // Index of the shaping run holding the character at offset
+    size_t findShapingRun(size_t offset) const;
+    
+    std::wstring_view mText;
+    uint64_t mHash;                 // LLArabicTextCache::hashText(mText)
+    bool mHasArabic;                // Arabic script, presentation forms included
+    bool mHasJoining;               // Arabic letters that take contextual forms
+    bool mHasParagraphSeparator;
+    bool mHasMarks;                 // Non-spacing marks
+    bool mPureRTL;                  // Arabic with only right-to-left letters, marks and spaces
+    
+private:
+    LLArabicTextAnalysis(const LLArabicTextAnalysis&) = delete;
+    LLArabicTextAnalysis& operator=(const LLArabicTextAnalysis&) = delete;
+    
+    void walk(bool per_character);
+    
+    // Analyses are never const objects, only passed as const to stages
+    void classify() const
+    {
+        if (!mClassified)
+        {
+            const_cast<LLArabicTextAnalysis*>(this)->walk(true);
+        }
+    }
+    
+    bool mClassified;
+    LLScratchBuffer<FriBidiCharType> mBidiTypes;
+    LLScratchBuffer<ShapingRun> mShapingRuns;
+    size_t mShapingRunCount;
+};
+
+LLArabicTextAnalysis::LLArabicTextAnalysis(std::wstring_view text, bool whole_text)
+    : mText(text)
+    , mHash(LLArabicTextCache::HASH_SEED)
+    , mHasArabic(false)
+    , mHasJoining(false)
+    , mHasParagraphSeparator(false)
+    , mHasMarks(false)
+    , mPureRTL(false)
+    , mClassified(false)
+    , mShapingRunCount(0)
+{
+    // Most UI text has no Arabic; it is not hashed or classified
+    if (findArabic(text) == text.size() && !whole_text)
+    {
+        return;
+    }
+    
+    // Short text gets everything in this walk, long text only what a cache
+    // lookup needs
+    walk(text.size() <= SMALL_TEXT_LENGTH);
+}
+
+size_t LLArabicTextAnalysis::findShapingRun(size_t offset) const
+{
+    const ShapingRun* runs = shapingRuns();
+    const ShapingRun* run = std::upper_bound(runs, runs + mShapingRunCount, offset,
+        [](size_t value, const ShapingRun& candidate) { return value < candidate.mStart; });
+    return static_cast<size_t>(run - runs) - 1;
+}
+
+size_t LLArabicTextAnalysis::findArabic(std::wstring_view text)
+{
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        if (isArabicCodepoint(text[i]))
+        {
+            return i;
+        }
+    }
+    return text.size();
+}
+
+void LLArabicTextAnalysis::walk(bool per_character)
+{
+    LL_ARABIC_TRACE_ZONE(zone, "analyseText");
+    LL_ARABIC_TRACE_LENGTH(zone, mText.size());
+    
+    if (per_character)
+    {
+        mBidiTypes.allocate(mText.size());
+        mShapingRuns.allocate(mText.size());
+        mShapingRunCount = 0;
+        mClassified = true;
+    }
+    
+    uint64_t hash = LLArabicTextCache::HASH_SEED;
+    bool has_mixed_direction = false;
+    for (size_t i = 0; i < mText.size(); ++i)
+    {
+        wchar_t ch = mText[i];
+        hash = LLArabicTextCache::hashStep(hash, ch);
+        FriBidiCharType type = fribidi_get_bidi_type(static_cast<FriBidiChar>(ch));
+        
+        if (isArabicCodepoint(ch))
+        {
+            mHasArabic = true;
+            if (type == FRIBIDI_TYPE_AL && !isPresentationForm(ch))
+            {
+                mHasJoining = true;
+            }
+        }
+        if (type == FRIBIDI_TYPE_BS)
+        {
+            mHasParagraphSeparator = true;
+        }
+        if (type == FRIBIDI_TYPE_NSM)
+        {
+            mHasMarks = true;
+        }
+        else if (type != FRIBIDI_TYPE_AL && type != FRIBIDI_TYPE_RTL && type != FRIBIDI_TYPE_WS)
+        {
+            has_mixed_direction = true;
+        }
+        
+        if (per_character)
+        {
+            mBidiTypes[i] = type;
+            EShapingRun run_type = shapingRunType(ch);
+            if (mShapingRunCount == 0 || mShapingRuns[mShapingRunCount - 1].mType != run_type)
+            {
+                mShapingRuns[mShapingRunCount++] = ShapingRun{ static_cast<uint32_t>(i), 0, run_type };
+            }
+            mShapingRuns[mShapingRunCount - 1].mLength++;
+        }
+    }
+    
+    mHash = hash;
+    
+    // With a right-to-left paragraph every character of such text resolves
+    // to level 1, so the UBA reduces to reversing the line
+    mPureRTL = mHasArabic && !has_mixed_direction;
+}
+
+LLArabicSupport& LLArabicSupport::instance()
+{
+    static LLArabicSupport sInstance;
+    return sInstance;
+}
+
+LLArabicSupport::LLArabicSupport()
+    : mFTFace(nullptr)
+    , mFTLibrary(nullptr)
+    , mOwnsFTFace(false)
+    , mHBFace(nullptr)
+    , mHBFont(nullptr)
+    , mFontLoaded(false)
+    , mInitialized(false)
+    , mEnableCache(true)
+    , mTextCache(nullptr)
+    , mSharedCache(nullptr)
+    , mFontIdentity(0)
+{
+    // Only records the budgets; the cache is created with the first
+    // Arabic text
+    setMaxCacheSize(DEFAULT_CACHE_SIZE);
+}
+
+LLArabicSupport::~LLArabicSupport()
+{
+    delete mTextCache.load();
+    delete mSharedCache.load();
+    
+    if (mHBFont)
+    {
+        hb_font_destroy(mHBFont);
+        mHBFont = nullptr;
+    }
+    
+    if (mHBFace)
+    {
+        hb_face_destroy(mHBFace);
+        mHBFace = nullptr;
+    }
+    
+    if (mOwnsFTFace)
+    {
+        FT_Done_Face(mFTFace);
+        mFTFace = nullptr;
+    }
+    
+    if (mFTLibrary)
+    {
+        FT_Done_FreeType(mFTLibrary);
+        mFTLibrary = nullptr;
+    }
+}
+
+bool LLArabicSupport::initialize(FT_Face font_face)
+{
+    std::lock_guard<std::mutex> lock(mInitMutex);
+    
+    if (mInitialized)
+    {
+        return true;
+    }
+    
+    if (!font_face)
+    {
+        return false;
+    }
+    
+    // The HarfBuzz font is created from the face with the first Arabic text
+    mFTFace = font_face;
+    mInitialized = true;
+    LLArabicLocalCache::invalidateAll();
+    return true;
+}
+
+bool LLArabicSupport::initialize(const std::string& font_path)
+{
+    std::lock_guard<std::mutex> lock(mInitMutex);
+    
+    if (mInitialized)
+    {
+        return true;
+    }
+    
+    if (font_path.empty())
+    {
+        return false;
+    }
+    
+    // Only checked here; nothing is read until the first Arabic text
+    if (!isReadableFile(font_path))
+    {
+        LL_ARABIC_WARN("Arabic font " << font_path << " is missing or unreadable");
+        return false;
+    }
+    
+    mFontPath = font_path;
+    mInitialized = true;
+    LLArabicLocalCache::invalidateAll();
+    return true;
+}
+
+bool LLArabicSupport::isFontLoaded() const
+{
+    return mFontLoaded.load(std::memory_order_acquire) && mHBFont;
+}
+
+hb_font_t* LLArabicSupport::getFont()
+{
+    if (!mInitialized)
+    {
+        return nullptr;
+    }
+    
+    if (!mFontLoaded.load(std::memory_order_acquire))
+    {
+        std::lock_guard<std::mutex> lock(mInitMutex);
+        if (!mFontLoaded.load(std::memory_order_relaxed))
+        {
+            loadFont();
+            mFontLoaded.store(true, std::memory_order_release);
+        }
+    }
+    return mHBFont;
+}
+
+void LLArabicSupport::loadFont()
+{
+    LL_ARABIC_TRACE_ZONE(zone, "loadFont");
+    
+    if (!mFontPath.empty())
+    {
+        // HarfBuzz memory-maps the file where the platform allows it, and
+        // the face only reads the tables shaping actually touches
+        hb_blob_t* blob = hb_blob_create_from_file(mFontPath.c_str());
+        if (hb_blob_get_length(blob) == 0)
+        {
+            LL_ARABIC_WARN("Could not read Arabic font " << mFontPath << ", text will not be shaped");
+            hb_blob_destroy(blob);
+            return;
+        }
+        
+        mHBFace = hb_face_create(blob, 0);
+        hb_blob_destroy(blob);  // The face holds its own reference
+        if (hb_face_get_glyph_count(mHBFace) == 0)
+        {
+            LL_ARABIC_WARN("Arabic font " << mFontPath << " has no glyphs, text will not be shaped");
+            hb_face_destroy(mHBFace);
+            mHBFace = nullptr;
+            return;
+        }
+        mHBFont = hb_font_create(mHBFace);
+    }
+    else if (mFTFace)
+    {
+        // Create HarfBuzz font from FreeType face
+        mHBFont = hb_ft_font_create(mFTFace, nullptr);
+    }
+}
+
+FT_Face LLArabicSupport::getFTFace()
+{
+    if (!mInitialized)
+    {
+        return nullptr;
+    }
+    
+    std::lock_guard<std::mutex> lock(mInitMutex);
+    if (!mFTFace && !mFontPath.empty() && !mFTLibrary)
+    {
+        // Only rasterizing needs a FreeType face of the file; HarfBuzz
+        // shapes from its own
+        if (FT_Init_FreeType(&mFTLibrary) == 0 &&
+            FT_New_Face(mFTLibrary, mFontPath.c_str(), 0, &mFTFace) == 0)
+        {
+            mOwnsFTFace = true;
+        }
+        else
+        {
+            mFTFace = nullptr;
+        }
+    }
+    return mFTFace;
+}
+
+LLArabicTextCache* LLArabicSupport::getTextCache()
+{
+    LLArabicTextCache* cache = mTextCache.load(std::memory_order_acquire);
+    if (!cache)
+    {
+        std::lock_guard<std::mutex> lock(mInitMutex);
+        cache = mTextCache.load(std::memory_order_relaxed);
+        if (!cache)
+        {
+            cache = new LLArabicTextCache();
+            for (int i = 0; i < CACHE_POOL_COUNT; ++i)
+            {
+                cache->setCapacity(static_cast<ECachePool>(i), mPoolCacheSize[i]);
+            }
+            mTextCache.store(cache, std::memory_order_release);
+        }
+    }
+    return cache;
+}
+
+LLArabicSharedCache* LLArabicSupport::getSharedCache(uint64_t& font_identity)
+{
+    LLArabicSharedCache* shared_cache = mSharedCache.load(std::memory_order_acquire);
+    if (!shared_cache)
+    {
+        return nullptr;
+    }
+    
+    font_identity = mFontIdentity.load(std::memory_order_relaxed);
+    if (font_identity == 0)
+    {
+        hb_font_t* font = getFont();
+        if (!font)
+        {
+            return nullptr;
+        }
+        
+        // The head table holds the font's revision, its creation and
+        // modification times and the checksum of the whole file, so it
+        // tells fonts apart without reading the rest of the file
+        hb_face_t* face = hb_font_get_face(font);
+        hb_blob_t* head = hb_face_reference_table(face, HB_TAG('h', 'e', 'a', 'd'));
+        unsigned int length = 0;
+        const char* data = hb_blob_get_data(head, &length);
+        if (length > 0)
+        {
+            font_identity = LLArabicTextCache::HASH_SEED;
+            for (unsigned int i = 0; i < length; ++i)
+            {
+                font_identity = LLArabicTextCache::hashStep(
+                    font_identity, static_cast<wchar_t>(static_cast<unsigned char>(data[i])));
+            }
+            font_identity = LLArabicTextCache::hashStep(
+                font_identity, static_cast<wchar_t>(hb_face_get_glyph_count(face)));
+        }
+        hb_blob_destroy(head);
+        
+        // Without a head table there is nothing safe to key on
+        if (font_identity == 0)
+        {
+            return nullptr;
+        }
+        mFontIdentity.store(font_identity, std::memory_order_relaxed);
+    }
+    return shared_cache;
+}
+
+bool LLArabicSupport::isArabicChar(wchar_t ch) const
+{
+    return isArabicCodepoint(ch);
+}
+
+bool LLArabicSupport::isDigit(wchar_t ch) const
+{
+    return (ch >= L'0' && ch <= L'9') ||       // ASCII digits
+           (ch >= 0x0660 && ch <= 0x0669) ||   // Arabic-Indic digits
+           (ch >= 0x06F0 && ch <= 0x06F9);     // Extended Arabic-Indic digits
+}
+
+bool LLArabicSupport::containsArabic(std::wstring_view text) const
+{
+    LL_ARABIC_TRACE_ZONE(zone, "containsArabic");
+    LL_ARABIC_TRACE_LENGTH(zone, text.size());
+    
+    return LLArabicTextAnalysis::findArabic(text) < text.size();
+}
+
+std::wstring LLArabicSupport::reorderBidiText(const std::wstring& input, ECachePool pool)
+{
+    if (input.empty())
+    {
+        return input;
+    }
+    
+    LLArabicTextCache* cache = mEnableCache ? getTextCache() : nullptr;
+    std::wstring result(input.size(), L'\0');
+    LLArabicTextAnalysis analysis(input, true);
+    if (!analysis.mHasParagraphSeparator)
+    {
+        reorderText(analysis, cache, pool, &result[0]);
+        return result;
+    }
+    
+    // Every paragraph is reordered on its own; separators stay in place
+    std::vector<LLParagraph> paragraphs;
+    splitParagraphs(input, paragraphs);
+    for (const LLParagraph& paragraph : paragraphs)
+    {
+        if (paragraph.mLength > 0)
+        {
+            LLArabicTextAnalysis paragraph_analysis(
+                std::wstring_view(input).substr(paragraph.mStart, paragraph.mLength), true);
+            reorderText(paragraph_analysis, cache, pool, &result[paragraph.mStart]);
+        }
+        std::copy_n(input.begin() + paragraph.mStart + paragraph.mLength,
+                    paragraph.mSeparatorLength,
+                    result.begin() + paragraph.mStart + paragraph.mLength);
+    }
+    return result;
+}
+
+void LLArabicSupport::reorderText(const LLArabicTextAnalysis& analysis, LLArabicTextCache* cache,
+                                  ECachePool pool, wchar_t* output, int* logical_index)
+{
+    std::wstring_view input = analysis.mText;
+    LL_ARABIC_TRACE_ZONE(zone, "reorderBidi");
+    LL_ARABIC_TRACE_LENGTH(zone, input.size());
+    
+    // Plain right-to-left text is reversed without FriBidi. That is cheaper
+    // than a cache lookup, so the cache is left to mixed text.
+    if (analysis.mPureRTL)
+    {
+        reverseText(input.data(), input.size(), output);
+        for (size_t i = 0; logical_index && i < input.size(); ++i)
+        {
+            logical_index[i] = static_cast<int>(input.size() - 1 - i);
+        }
+        if (analysis.mHasMarks)
+        {
+            keepMarksAfterBase(analysis.bidiTypes(), input.size(), output);
+            if (logical_index)
+            {
+                keepMarksAfterBase(analysis.bidiTypes(), input.size(), logical_index);
+            }
+        }
+        return;
+    }
+    
+    // Check cache first; it does not keep the visual map
+    if (cache && !logical_index)
+    {
+        LLArabicEpochGuard guard;
+        std::wstring_view cached;
+        if (cache->lookup(input, analysis.mHash, LLArabicTextCache::STAGE_BIDI, pool, cached))
+        {
+            LL_ARABIC_TRACE_CACHE(zone, "hit");
+            std::copy(cached.begin(), cached.end(), output);
+            return;
+        }
+        LL_ARABIC_TRACE_CACHE(zone, "miss");
+    }
+    
+    // Prepare buffers (on the stack for short text); the character types
+    // come from the analysis
+    size_t length = input.length();
+    LLScratchBuffer<FriBidiChar> visual_str(length);
+    LLScratchBuffer<FriBidiLevel> embedding_levels(length);
+    const FriBidiCharType* bidi_types = analysis.bidiTypes();
+    
+    // fribidi_reorder_line() permutes visual_str in place, so it starts
+    // out as a copy of the logical text
+    for (size_t i = 0; i < length; ++i)
+    {
+        visual_str[i] = static_cast<FriBidiChar>(input[i]);
+    }
+    for (size_t i = 0; logical_index && i < length; ++i)
+    {
+        logical_index[i] = static_cast<int>(i);
+    }
+    
+    // Set paragraph direction to RTL for Arabic text
+    FriBidiParType base_dir = analysis.mHasArabic ? FRIBIDI_PAR_RTL : FRIBIDI_PAR_LTR;
+    
+    LL_ARABIC_TRACE_ZONE(fribidi_zone, "fribidi");
+    
+    // Get embedding levels (FriBidi returns the highest level plus one,
+    // or zero on failure)
+    FriBidiLevel max_level = fribidi_get_par_embedding_levels(
+        bidi_types, length, &base_dir, embedding_levels.data());
+    
+    bool reordered = max_level > 1 &&
+        fribidi_reorder_line(
+            FRIBIDI_FLAGS_DEFAULT,
+            bidi_types, length,
+            0, base_dir,
+            embedding_levels.data(),
+            visual_str.data(),
+            logical_index);
+    
+    if (reordered)
+    {
+        for (size_t i = 0; i < length; ++i)
+        {
+            output[i] = static_cast<wchar_t>(visual_str[i]);
+        }
+    }
+    else
+    {
+        // Nothing to reorder, or reordering failed: keep the original
+        std::copy(input.begin(), input.end(), output);
+        for (size_t i = 0; logical_index && i < length; ++i)
+        {
+            logical_index[i] = static_cast<int>(i);
+        }
+    }
+    
+    // Cache the result
+    if (cache && !logical_index)
+    {
+        cache->insert(input, analysis.mHash, LLArabicTextCache::STAGE_BIDI,
+                      std::wstring_view(output, length), pool);
+    }
+}
+
+std::wstring LLArabicSupport::shapeArabicText(const std::wstring& input)
+{
+    LLArabicTextAnalysis analysis(input);
+    size_t glyph_count = shapeText(input, analysis);
+    if (glyph_count == 0)
+    {
+        return input;
+    }
+    
+    std::wstring result(glyph_count, L'\0');
+    copyShapedGlyphs(&result[0], glyph_count);
+    return result;
+}
+
+size_t LLArabicSupport::shapeText(std::wstring_view input, const LLArabicTextAnalysis& analysis)
+{
+    if (input.empty() || !mInitialized)
+    {
+        return 0;
+    }
+    
+    // Only shape if some letters change form; digits and already shaped
+    // presentation forms are left as they are
+    if (!analysis.mHasJoining)
+    {
+        return 0;
+    }
+    
+    // The font is loaded with the first Arabic text
+    hb_font_t* font = getFont();
+    if (!font)
+    {
+        return 0;
+    }
+    
+    hb_buffer_t* buffer = getShapingBuffer();
+    if (!buffer)
+    {
+        return 0;
+    }
+    
+    // Clear HarfBuzz buffer (keeps its allocation for the next call)
+    hb_buffer_clear_contents(buffer);
+    
+    // Add text to buffer
+    for (size_t i = 0; i < input.length(); ++i)
+    {
+        hb_buffer_add(buffer, static_cast<hb_codepoint_t>(input[i]), i);
+    }
+    
+    // Shape the text
+    shapeRightToLeft(font, buffer);
+    
+    unsigned int glyph_count = 0;
+    hb_buffer_get_glyph_infos(buffer, &glyph_count);
+    return glyph_count;
+}
+
+bool LLArabicSupport::shapeRuns(std::wstring_view input, const int* logical_index,
+                                const LLArabicTextAnalysis& analysis,
+                                LLArabicTextCache* cache, ECachePool pool,
+                                wchar_t* output, size_t capacity, size_t& glyph_count)
+{
+    glyph_count = 0;
+    if (input.empty() || !mInitialized || !analysis.mHasJoining)
+    {
+        return false;
+    }
+    
+    hb_font_t* font = getFont();
+    hb_buffer_t* buffer = font ? getShapingBuffer() : nullptr;
+    if (!buffer)
+    {
+        return false;
+    }
+    
+    LL_ARABIC_TRACE_ZONE(zone, "shapeRuns");
+    LL_ARABIC_TRACE_LENGTH(zone, input.size());
+    
+    // A run's glyphs depend on its text and on whether the characters on
+    // either side can join it, so the key is the run between its joining
+    // context (0 where a space, the line edge or a non-joining character
+    // borders it). Runs are shaped with that context and give the glyphs
+    // shaping the whole line would. The font is not part of the key: it is
+    // fixed by initialize() for the life of the cache.
+    LLScratchBuffer<wchar_t> key(input.size() + 2);
+    LLScratchBuffer<hb_codepoint_t> codepoints(input.size() + 2);
+    LLArabicEpochGuard guard;
+    
+    // HarfBuzz returns right-to-left text last character first, so the
+    // runs are emitted from the end of the line. The runs come from the
+    // analysis: a visual run is the part of a logical run that reordering
+    // kept together.
+    const LLArabicTextAnalysis::ShapingRun* runs = analysis.shapingRuns();
+    size_t end = input.size();
+    while (end > 0)
+    {
+        size_t start = end - 1;
+        const LLArabicTextAnalysis::ShapingRun& logical_run =
+            runs[analysis.findShapingRun(static_cast<size_t>(logical_index[start]))];
+        EShapingRun type = logical_run.mType;
+        while (start > 0 && logical_run.contains(static_cast<size_t>(logical_index[start - 1])))
+        {
+            --start;
+        }
+        
+        size_t length = end - start;
+        wchar_t before = start > 0 ? input[start - 1] : 0;
+        wchar_t after = end < input.size() ? input[end] : 0;
+        bool joins = type != SHAPING_RUN_SPACE;
+        key[0] = (joins && isJoiningContext(before)) ? before : 0;
+        key[length + 1] = (joins && isJoiningContext(after)) ? after : 0;
+        std::copy(input.begin() + start, input.begin() + end, key.data() + 1);
+        std::wstring_view run_key(key.data(), length + 2);
+        
+        // Whitespace runs are shaped in place: they are cheap to shape and
+        // would fill the run slabs and hit counters with one-glyph entries
+        uint64_t hash = joins ? LLArabicTextCache::hashText(run_key) : 0;
+        std::wstring_view glyphs;
+        if (!joins || !cache->lookup(run_key, hash, LLArabicTextCache::STAGE_RUN, pool, glyphs))
+        {
+            // HarfBuzz takes the context from the characters around the item
+            size_t first = key[0] ? 0 : 1;
+            size_t last = key[length + 1] ? length + 2 : length + 1;
+            for (size_t i = first; i < last; ++i)
+            {
+                codepoints[i - first] = static_cast<hb_codepoint_t>(key[i]);
+            }
+            
+            hb_buffer_clear_contents(buffer);
+            hb_buffer_add_codepoints(buffer, codepoints.data(), static_cast<int>(last - first),
+                                     static_cast<unsigned int>(1 - first), static_cast<int>(length));
+            shapeRightToLeft(font, buffer);
+            
+            unsigned int shaped = 0;
+            hb_glyph_info_t* glyph_info = hb_buffer_get_glyph_infos(buffer, &shaped);
+            if (glyph_count + shaped > capacity)
+            {
+                return false;
+            }
+            for (unsigned int g = 0; g < shaped; ++g)
+            {
+                output[glyph_count + g] = static_cast<wchar_t>(glyph_info[g].codepoint);
+            }
+            glyphs = std::wstring_view(output + glyph_count, shaped);
+            if (joins)
+            {
+                cache->insert(run_key, hash, LLArabicTextCache::STAGE_RUN, glyphs, pool);
+            }
+        }
+        else if (glyph_count + glyphs.size() > capacity)
+        {
+            return false;
+        }
+        else
+        {
+            std::copy(glyphs.begin(), glyphs.end(), output + glyph_count);
+        }
+        
+        glyph_count += glyphs.size();
+        end = start;
+    }
+    return true;
+}
+
+void LLArabicSupport::copyShapedGlyphs(wchar_t* output, size_t glyph_count)
+{
+    // Get glyph information from this thread's buffer
+    unsigned int available = 0;
+    hb_glyph_info_t* glyph_info = hb_buffer_get_glyph_infos(getShapingBuffer(), &available);
+    
+    for (size_t i = 0; i < glyph_count && i < available; ++i)
+    {
+        // Note: In a real implementation, you would map glyph IDs to Unicode
+        // For now, we use the codepoint which HarfBuzz provides
+        output[i] = static_cast<wchar_t>(glyph_info[i].codepoint);
+    }
+}
+
+std::wstring LLArabicSupport::processArabicDocument(const std::wstring& input, ECachePool pool)
+{
+    LLArabicTextAnalysis analysis(input);
+    if (!analysis.needsProcessing())
+    {
+        return input;
+    }
+    
+    std::wstring result;
+    processDocument(input, pool, nullptr, 0, &result);
+    return result;
+}
+
+std::wstring LLArabicSupport::processArabicText(const std::wstring& input, ECachePool pool)
+{
+    std::wstring result;
+    processText(input, pool, nullptr, 0, &result);
+    return result;
+}
+
+size_t LLArabicSupport::processArabicText(std::wstring_view input, wchar_t* output,
+                                          size_t capacity, ECachePool pool)
+{
+    return processText(input, pool, output, capacity, nullptr);
+}
+
+bool LLArabicSupport::findProcessedText(std::wstring_view input, CachedText& text,
+                                        ECachePool pool)
+{
+    text.release();
+    
+    // Check if processing is needed
+    LLArabicTextAnalysis analysis(input);
+    if (!analysis.needsProcessing())
+    {
+        text.mText = input;
+        return true;
+    }
+    
+    LLArabicTextCache* cache = mTextCache.load(std::memory_order_acquire);
+    if (!mEnableCache || !cache)
+    {
+        return false;
+    }
+    
+    // Pin the current epoch; CachedText releases it
+    LLArabicEpochDomain& domain = LLArabicEpochDomain::instance();
+    domain.enter(domain.threadRecord());
+    
+    std::wstring_view cached;
+    if (cache->lookup(input, analysis.mHash, LLArabicTextCache::STAGE_FULL, pool, cached, false))
+    {
+        text.mText = cached;
+        text.mPinned = true;
+        return true;
+    }
+    
+    domain.exit(domain.threadRecord());
+    return false;
+}
+
+size_t LLArabicSupport::processText(std::wstring_view input, ECachePool pool,
+                                    wchar_t* output, size_t capacity,
+                                    std::wstring* overflow)
+{
+    LL_ARABIC_TRACE_ZONE(zone, "processArabicText");
+    LL_ARABIC_TRACE_LENGTH(zone, input.size());
+    
+    // One walk over the text tells every stage what it needs to know
+    LLArabicTextAnalysis analysis(input);
+    if (!analysis.needsProcessing())
+    {
+        return emitText(input, output, capacity, overflow);
+    }
+    
+    // Bidi runs per paragraph; multi-paragraph text is split up and every
+    // paragraph is cached on its own
+    if (analysis.mHasParagraphSeparator)
+    {
+        return processDocument(input, pool, output, capacity, overflow);
+    }
+    
+    // Check this thread's cache, then the process's, then the one shared
+    // with other viewer instances
+    LLArabicTextCache* cache = mEnableCache ? getTextCache() : nullptr;
+    if (cache)
+    {
+        LLArabicLocalCache& local_cache = LLArabicLocalCache::instance();
+        std::wstring_view cached;
+        if (local_cache.lookup(analysis.mHash, input, cached))
+        {
+            LL_ARABIC_TRACE_CACHE(zone, "local hit");
+            cache->countLocalHit(analysis.mHash, LLArabicTextCache::STAGE_FULL, pool);
+            return emitText(cached, output, capacity, overflow);
+        }
+        
+        LLArabicEpochGuard guard;
+        if (cache->lookup(input, analysis.mHash, LLArabicTextCache::STAGE_FULL, pool, cached))
+        {
+            LL_ARABIC_TRACE_CACHE(zone, "hit");
+            local_cache.insert(analysis.mHash, input, cached);
+            return emitText(cached, output, capacity, overflow);
+        }
+        
+        uint64_t font_identity = 0;
+        LLArabicSharedCache* shared_cache = getSharedCache(font_identity);
+        wchar_t shared[LLArabicSharedCache::SLOT_CHARS];
+        size_t shared_length = 0;
+        if (shared_cache &&
+            shared_cache->lookup(analysis.mHash, font_identity, input, shared, shared_length))
+        {
+            LL_ARABIC_TRACE_CACHE(zone, "shared hit");
+            std::wstring_view result(shared, shared_length);
+            cache->insert(input, analysis.mHash, LLArabicTextCache::STAGE_FULL, result, pool);
+            local_cache.insert(analysis.mHash, input, result);
+            return emitText(result, output, capacity, overflow);
+        }
+        LL_ARABIC_TRACE_CACHE(zone, "miss");
+    }
+    
+    // Step 1: Reorder bidirectional text. Only the final result is cached;
+    // a bidi entry as well would store the same input twice.
+    LLScratchBuffer<wchar_t> reordered(input.size());
+    LLScratchBuffer<int> logical_index(cache ? input.size() : 0);
+    reorderText(analysis, nullptr, pool, reordered.data(), cache ? logical_index.data() : nullptr);
+    std::wstring_view result(reordered.data(), input.size());
+    
+    // Step 2: Shape Arabic characters. With the cache, runs shaped for
+    // earlier lines are reused and only new runs go through HarfBuzz; the
+    // whole line is shaped at once if the glyphs outgrow the buffer.
+    size_t shaped_capacity = 2 * input.size();
+    LLScratchBuffer<wchar_t, 2 * SMALL_TEXT_LENGTH> shaped(shaped_capacity);
+    size_t glyph_count = 0;
+    if (!cache ||
+        !shapeRuns(result, logical_index.data(), analysis, cache, pool,
+                   shaped.data(), shaped_capacity, glyph_count))
+    {
+        glyph_count = shapeText(result, analysis);
+        shaped.allocate(glyph_count);
+        copyShapedGlyphs(shaped.data(), glyph_count);
+    }
+    if (glyph_count > 0)
+    {
+        result = std::wstring_view(shaped.data(), glyph_count);
+    }
+    
+    // Cache the final result
+    if (cache)
+    {
+        cache->insert(input, analysis.mHash, LLArabicTextCache::STAGE_FULL, result, pool);
+        LLArabicLocalCache::instance().insert(analysis.mHash, input, result);
+        
+        LLArabicEpochGuard guard;
+        uint64_t font_identity = 0;
+        LLArabicSharedCache* shared_cache = getSharedCache(font_identity);
+        if (shared_cache)
+        {
+            shared_cache->insert(analysis.mHash, font_identity, input, result);
+        }
+    }
+    
+    return emitText(result, output, capacity, overflow);
+}
+
+size_t LLArabicSupport::processDocument(std::wstring_view input, ECachePool pool,
+                                        wchar_t* output, size_t capacity,
+                                        std::wstring* overflow)
+{
+    LL_ARABIC_TRACE_ZONE(zone, "processDocument");
+    LL_ARABIC_TRACE_LENGTH(zone, input.size());
+    
+    // Short documents for a caller's buffer are written straight into it,
+    // one paragraph after the other, so they allocate no more than their
+    // paragraphs do
+    if (!overflow && input.size() < PARALLEL_DOCUMENT_LENGTH)
+    {
+        size_t length = 0;
+        size_t start = 0;
+        while (true)
+        {
+            LLParagraph paragraph = findParagraph(input, start);
+            size_t written = std::min(length, capacity);
+            length += processText(input.substr(paragraph.mStart, paragraph.mLength), pool,
+                                  output + written, capacity - written, nullptr);
+            
+            std::wstring_view separator = input.substr(paragraph.mStart + paragraph.mLength,
+                                                       paragraph.mSeparatorLength);
+            if (length + separator.size() <= capacity)
+            {
+                std::copy(separator.begin(), separator.end(), output + length);
+            }
+            length += separator.size();
+            
+            if (separator.empty())
+            {
+                return length;
+            }
+            start = paragraph.mStart + paragraph.mLength + separator.size();
+        }
+    }
+    
+    std::vector<LLParagraph> paragraphs;
+    splitParagraphs(input, paragraphs);
+    
+    std::vector<std::wstring> results(paragraphs.size());
+    std::function<void(size_t)> process_paragraph = [&](size_t i)
+    {
+        std::wstring_view paragraph = input.substr(paragraphs[i].mStart, paragraphs[i].mLength);
+        processText(paragraph, pool, nullptr, 0, &results[i]);
+    };
+    
+    if (input.size() >= PARALLEL_DOCUMENT_LENGTH && paragraphs.size() > 1)
+    {
+        LLArabicWorkerPool::instance().parallelFor(paragraphs.size(), process_paragraph);
+    }
+    else
+    {
+        for (size_t i = 0; i < paragraphs.size(); ++i)
+        {
+            process_paragraph(i);
+        }
+    }
+    
+    // Join the paragraphs, keeping the original separators
+    size_t length = 0;
+    for (size_t i = 0; i < paragraphs.size(); ++i)
+    {
+        length += results[i].size() + paragraphs[i].mSeparatorLength;
+    }
+    
+    if (length > capacity)
+    {
+        if (!overflow)
+        {
+            return length;
+        }
+        overflow->resize(length);
+        output = &(*overflow)[0];
+    }
+    
+    for (size_t i = 0; i < paragraphs.size(); ++i)
+    {
+        output = std::copy(results[i].begin(), results[i].end(), output);
+        std::wstring_view separator = input.substr(paragraphs[i].mStart + paragraphs[i].mLength,
+                                                   paragraphs[i].mSeparatorLength);
+        output = std::copy(separator.begin(), separator.end(), output);
+    }
+    
+    return length;
+}
+
+size_t LLArabicSupport::emitText(std::wstring_view text, wchar_t* output, size_t capacity,
+                                 std::wstring* overflow)
+{
+    if (text.size() <= capacity)
+    {
+        std::copy(text.begin(), text.end(), output);
+    }
+    else if (overflow)
+    {
+        overflow->assign(text.data(), text.size());
+    }
+    return text.size();
+}
+
+void LLArabicSupport::setEnableCache(bool enable)
+{
+    mEnableCache = enable;
+    LLArabicLocalCache::invalidateAll();
+}
+
+void LLArabicSupport::clearCache()
+{
+    LLArabicLocalCache::invalidateAll();
+    LLArabicTextCache* cache = mTextCache.load(std::memory_order_acquire);
+    if (cache)
+    {
+        cache->clear();
+    }
+}
+
+void LLArabicSupport::getCacheStats(size_t& cache_size, size_t& hit_count, 
+                                    size_t& miss_count) const
+{
+    CacheStats stats;
+    getCacheStats(stats);
+    
+    cache_size = hit_count = miss_count = 0;
+    for (int i = 0; i < CACHE_POOL_COUNT; ++i)
+    {
+        cache_size += stats.mEntries[i];
+        hit_count += stats.mHits[i];
+        miss_count += stats.mMisses[i];
+    }
+}
+
+void LLArabicSupport::getCacheStats(CacheStats& stats) const
+{
+    LLArabicTextCache* cache = mTextCache.load(std::memory_order_acquire);
+    if (cache)
+    {
+        cache->getStats(stats);
+    }
+    else
+    {
+        // Nothing processed yet
+        stats = CacheStats();
+        for (int i = 0; i < CACHE_POOL_COUNT; ++i)
+        {
+            stats.mCapacity[i] = mPoolCacheSize[i];
+        }
+    }
+    
+    LLArabicEpochGuard guard;
+    LLArabicSharedCache* shared_cache = mSharedCache.load(std::memory_order_acquire);
+    if (shared_cache)
+    {
+        shared_cache->getStats(stats);
+    }
+    else
+    {
+        stats.mSharedHits = stats.mSharedMisses = stats.mSharedCorrupt = 0;
+    }
+}
+
+void LLArabicSupport::setMaxCacheSize(size_t max_size)
+{
+    size_t ui_size = max_size / 2;
+    setPoolCacheSize(CACHE_POOL_UI, ui_size);
+    setPoolCacheSize(CACHE_POOL_CHAT, max_size - ui_size);
+}
+
+void LLArabicSupport::handleMemoryPressure()
+{
+    LLArabicTextCache* cache = mTextCache.load(std::memory_order_acquire);
+    if (cache)
+    {
+        cache->shrink();
+    }
+}
+
+void LLArabicSupport::setPoolCacheSize(ECachePool pool, size_t max_size)
 {
-    static LLArabicSupport sInstance;
-    return sInstance;
+    std::lock_guard<std::mutex> lock(mInitMutex);
+    mPoolCacheSize[pool] = max_size;
+    
+    LLArabicTextCache* cache = mTextCache.load(std::memory_order_relaxed);
+    if (cache)
+    {
+        cache->setCapacity(pool, max_size);
+    }
 }
 
-LLArabicSupport::LLArabicSupport()
-    : mHBBuffer(nullptr)
-    , mHBFont(nullptr)
-    , mInitialized(false)
-    , mEnableCache(true)
-    , mMaxCacheSize(1000)
-    , mCacheHits(0)
-    , mCacheMisses(0)
+bool LLArabicSupport::openSharedCache(const std::string& name, size_t max_size)
 {
-    // Create HarfBuzz buffer
-    mHBBuffer = hb_buffer_create();
-    
-    if (!hb_buffer_allocation_successful(mHBBuffer))
+    // Readers may still be inside the previous segment; it is unmapped
+    // once they have left
+    LLArabicSharedCache* shared_cache = LLArabicSharedCache::open(name, max_size);
+    LLArabicSharedCache* previous = mSharedCache.exchange(shared_cache, std::memory_order_acq_rel);
+    if (previous)
     {
-        hb_buffer_destroy(mHBBuffer);
-        mHBBuffer = nullptr;
+        LLArabicEpochDomain::instance().retire(previous, &LLArabicSharedCache::destroy);
     }
+    return shared_cache != nullptr;
 }
 
-LLArabicSupport::~LLArabicSupport()
+void LLArabicSupport::closeSharedCache()
+{
+    LLArabicSharedCache* previous = mSharedCache.exchange(nullptr, std::memory_order_acq_rel);
+    if (previous)
+    {
+        LLArabicEpochDomain::instance().retire(previous, &LLArabicSharedCache::destroy);
+    }
+}
+
+bool LLArabicSupport::startTrace(const std::string& filename)
+{
+#if LL_ARABIC_TRACING
+    return LLArabicTraceLog::instance().start(filename);
+#else
+    (void)filename;
+    return false;
+#endif
+}
+
+void LLArabicSupport::stopTrace()
+{
+#if LL_ARABIC_TRACING
+    LLArabicTraceLog::instance().stop();
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// LLArabicSupport::CachedText implementation
+//-----------------------------------------------------------------------------
+
+void LLArabicSupport::CachedText::release()
 {
-    if (mHBBuffer)
+    if (mPinned)
     {
-        hb_buffer_destroy(mHBBuffer);
-        mHBBuffer = nullptr;
+        LLArabicEpochDomain& domain = LLArabicEpochDomain::instance();
+        domain.exit(domain.threadRecord());
+        mPinned = false;
     }
+    mText = std::wstring_view();
+}
+
+//-----------------------------------------------------------------------------
+// LLArabicTextLayout implementation
+//-----------------------------------------------------------------------------
+
+LLArabicTextLayout::LLArabicTextLayout(std::wstring_view text, float font_size)
+    : mFontSize(font_size)
+    , mNaturalWidth(0.f)
+{
+    LL_ARABIC_TRACE_ZONE(zone, "layoutText");
+    LL_ARABIC_TRACE_LENGTH(zone, text.size());
     
-    if (mHBFont)
+    std::vector<LLParagraph> paragraphs;
+    splitParagraphs(text, paragraphs);
+    for (const LLParagraph& paragraph : paragraphs)
     {
-        hb_font_destroy(mHBFont);
-        mHBFont = nullptr;
+        analyseParagraph(text.substr(paragraph.mStart, paragraph.mLength), paragraph.mStart);
     }
 }
 
-bool LLArabicSupport::initialize(FT_Face font_face)
+void LLArabicTextLayout::analyseParagraph(std::wstring_view text, size_t start)
 {
-    if (mInitialized)
+    size_t length = text.size();
+    Paragraph paragraph = { start, mSegments.size(), 0, 0 };
+    if (length == 0)
     {
-        return true;
+        mParagraphs.push_back(paragraph);
+        return;
     }
     
-    if (!font_face)
+    // Embedding levels are resolved for the whole paragraph once; lines
+    // are cut from them in wrap(). Plain right-to-left text is all level 1.
+    LLArabicTextAnalysis analysis(text, true);
+    
+    // Only paragraphs with Arabic are shaped with the Arabic font, and only
+    // they load it; others are measured without it
+    hb_font_t* font = analysis.mHasArabic ? LLArabicSupport::instance().getFont() : nullptr;
+    
+    LLScratchBuffer<unsigned char> levels(length);
+    if (analysis.mPureRTL)
     {
-        return false;
+        paragraph.mBaseLevel = 1;
+        std::fill_n(levels.data(), length, 1);
     }
-    
-    // Clean up old font if exists
-    if (mHBFont)
+    else
     {
-        hb_font_destroy(mHBFont);
-        mHBFont = nullptr;
+        LLScratchBuffer<FriBidiLevel> embedding_levels(length);
+        FriBidiParType base_dir = analysis.mHasArabic ? FRIBIDI_PAR_RTL : FRIBIDI_PAR_LTR;
+        FriBidiLevel max_level = fribidi_get_par_embedding_levels(
+            analysis.bidiTypes(), length, &base_dir, embedding_levels.data());
+        
+        paragraph.mBaseLevel = (base_dir == FRIBIDI_PAR_RTL) ? 1 : 0;
+        for (size_t i = 0; i < length; ++i)
+        {
+            levels[i] = max_level > 0 ? static_cast<unsigned char>(embedding_levels[i])
+                                      : paragraph.mBaseLevel;
+        }
     }
     
-    // Create HarfBuzz font from FreeType face
-    mHBFont = hb_ft_font_create(font_face, nullptr);
-    
-    if (!mHBFont)
+    // One segment per word and the spaces after it, from the shaping runs
+    // of the analysis
+    const LLArabicTextAnalysis::ShapingRun* runs = analysis.shapingRuns();
+    size_t run_count = analysis.shapingRunCount();
+    float width = 0.f;
+    size_t run = 0;
+    while (run < run_count)
     {
-        return false;
+        size_t word_start = runs[run].mStart;
+        while (run < run_count && runs[run].mType != SHAPING_RUN_SPACE)
+        {
+            ++run;
+        }
+        size_t word_end = run < run_count ? runs[run].mStart : length;
+        size_t space_end = word_end;
+        if (run < run_count)
+        {
+            space_end += runs[run].mLength;
+            ++run;
+        }
+        
+        Segment segment = { mRuns.size(), 0, 0.f, 0.f };
+        segment.mWidth = addRuns(text, word_start, word_end, start, levels.data(), false, font);
+        segment.mSpaceWidth = addRuns(text, word_end, space_end, start, levels.data(), true, font);
+        segment.mRunCount = mRuns.size() - segment.mFirstRun;
+        mSegments.push_back(segment);
+        
+        width += segment.mWidth;
+        mNaturalWidth = std::max(mNaturalWidth, width);
+        width += segment.mSpaceWidth;
     }
     
-    mInitialized = true;
-    return true;
-}
-
-bool LLArabicSupport::isArabicChar(wchar_t ch) const
-{
-    // Unicode ranges for Arabic script
-    return (ch >= 0x0600 && ch <= 0x06FF) ||  // Arabic
-           (ch >= 0x0750 && ch <= 0x077F) ||  // Arabic Supplement
-           (ch >= 0x08A0 && ch <= 0x08FF) ||  // Arabic Extended-A
-           (ch >= 0xFB50 && ch <= 0xFDFF) ||  // Arabic Presentation Forms-A
-           (ch >= 0xFE70 && ch <= 0xFEFF);    // Arabic Presentation Forms-B
+    paragraph.mSegmentCount = mSegments.size() - paragraph.mFirstSegment;
+    mParagraphs.push_back(paragraph);
 }
 
-bool LLArabicSupport::isDigit(wchar_t ch) const
+float LLArabicTextLayout::addRuns(std::wstring_view text, size_t start, size_t end, size_t offset,
+                                  const unsigned char* levels, bool space, hb_font_t* font)
 {
-    return (ch >= L'0' && ch <= L'9') ||       // ASCII digits
-           (ch >= 0x0660 && ch <= 0x0669) ||   // Arabic-Indic digits
-           (ch >= 0x06F0 && ch <= 0x06F9);     // Extended Arabic-Indic digits
+    hb_buffer_t* buffer = font ? getShapingBuffer() : nullptr;
+    float scale = 0.f;
+    if (buffer)
+    {
+        int x_scale = 0;
+        int y_scale = 0;
+        hb_font_get_scale(font, &x_scale, &y_scale);
+        scale = x_scale ? mFontSize / x_scale : 0.f;
+    }
+    
+    float total = 0.f;
+    while (start < end)
+    {
+        size_t run_end = start + 1;
+        while (run_end < end && levels[run_end] == levels[start])
+        {
+            ++run_end;
+        }
+        
+        Run run = { offset + start, run_end - start, mGlyphs.size(), 0, 0.f, levels[start], space };
+        bool rtl = (run.mLevel & 1) != 0;
+        if (buffer)
+        {
+            // HarfBuzz returns the glyphs of an RTL run in visual order
+            hb_buffer_clear_contents(buffer);
+            for (size_t i = start; i < run_end; ++i)
+            {
+                hb_buffer_add(buffer, static_cast<hb_codepoint_t>(text[i]), i - start);
+            }
+            hb_buffer_set_direction(buffer, rtl ? HB_DIRECTION_RTL : HB_DIRECTION_LTR);
+            hb_buffer_guess_segment_properties(buffer);
+            hb_shape(font, buffer, nullptr, 0);
+            
+            unsigned int glyph_count = 0;
+            hb_glyph_info_t* glyph_info = hb_buffer_get_glyph_infos(buffer, &glyph_count);
+            hb_glyph_position_t* glyph_pos = hb_buffer_get_glyph_positions(buffer, nullptr);
+            for (unsigned int g = 0; g < glyph_count; ++g)
+            {
+                mGlyphs.push_back(Glyph{ glyph_info[g].codepoint, glyph_pos[g].x_advance * scale });
+            }
+        }
+        else
+        {
+            // No font: characters stand in for glyphs
+            for (size_t g = 0; g < run.mLength; ++g)
+            {
+                wchar_t ch = text[rtl ? run_end - 1 - g : start + g];
+                mGlyphs.push_back(Glyph{ static_cast<unsigned int>(ch), mFontSize * 0.5f });
+            }
+        }
+        
+        run.mGlyphCount = mGlyphs.size() - run.mFirstGlyph;
+        for (size_t g = run.mFirstGlyph; g < mGlyphs.size(); ++g)
+        {
+            run.mWidth += mGlyphs[g].mAdvance;
+        }
+        total += run.mWidth;
+        mRuns.push_back(run);
+        start = run_end;
+    }
+    return total;
 }
 
-bool LLArabicSupport::containsArabic(const std::wstring& text) const
+void LLArabicTextLayout::wrap(float width, std::vector<Line>& lines) const
 {
-    for (wchar_t ch : text)
+    LL_ARABIC_TRACE_ZONE(zone, "wrapText");
+    
+    lines.clear();
+    for (const Paragraph& paragraph : mParagraphs)
     {
-        if (isArabicChar(ch))
+        // Greedy: fill every line with as many words as fit
+        size_t end = paragraph.mFirstSegment + paragraph.mSegmentCount;
+        size_t first = paragraph.mFirstSegment;
+        float line_width = 0.f;
+        for (size_t i = first; i < end; ++i)
         {
-            return true;
+            const Segment& segment = mSegments[i];
+            if (i > first && line_width + segment.mWidth > width)
+            {
+                appendLine(paragraph, first, i, lines);
+                first = i;
+                line_width = 0.f;
+            }
+            line_width += segment.mWidth + segment.mSpaceWidth;
         }
+        appendLine(paragraph, first, end, lines);
     }
-    return false;
 }
 
-std::wstring LLArabicSupport::reorderBidiText(const std::wstring& input)
+void LLArabicTextLayout::appendLine(const Paragraph& paragraph, size_t first_segment,
+                                    size_t end_segment, std::vector<Line>& lines) const
 {
-    if (input.empty())
+    Line line = { paragraph.mStart, 0, 0.f, std::wstring() };
+    if (first_segment == end_segment)
     {
-        return input;
+        // Empty paragraph
+        lines.push_back(line);
+        return;
+    }
+    
+    size_t first_run = mSegments[first_segment].mFirstRun;
+    const Segment& last = mSegments[end_segment - 1];
+    size_t end_run = last.mFirstRun + last.mRunCount;
+    line.mStart = mRuns[first_run].mStart;
+    line.mLength = mRuns[end_run - 1].mStart + mRuns[end_run - 1].mLength - line.mStart;
+    
+    // Rule L1 puts the spaces at the end of the line at the paragraph
+    // level; they are not drawn, so they are left out altogether
+    while (end_run > first_run && mRuns[end_run - 1].mSpace)
+    {
+        --end_run;
     }
     
-    // Check cache first
-    if (mEnableCache)
+    // Rule L2 on whole runs: from the highest level down to the lowest odd
+    // level, reverse every sequence of runs at that level or above
+    size_t count = end_run - first_run;
+    LLScratchBuffer<size_t> order(count);
+    int max_level = 0;
+    int min_odd_level = 255;
+    for (size_t i = 0; i < count; ++i)
     {
-        std::wstring cached = getCachedText(input);
-        if (!cached.empty())
+        order[i] = first_run + i;
+        int level = mRuns[first_run + i].mLevel;
+        max_level = std::max(max_level, level);
+        if (level & 1)
         {
-            return cached;
+            min_odd_level = std::min(min_odd_level, level);
         }
     }
     
-    // Prepare buffers
-    size_t length = input.length();
-    std::vector<FriBidiChar> unicode_str(length);
-    std::vector<FriBidiChar> visual_str(length);
-    std::vector<FriBidiCharType> bidi_types(length);
-    std::vector<FriBidiLevel> embedding_levels(length);
-    std::vector<FriBidiStrIndex> positions_map(length);
-    
-    // Copy input to FriBidi format
-    for (size_t i = 0; i < length; ++i)
+    for (int level = max_level; level >= min_odd_level; --level)
     {
-        unicode_str[i] = static_cast<FriBidiChar>(input[i]);
+        size_t i = 0;
+        while (i < count)
+        {
+            if (mRuns[order[i]].mLevel < level)
+            {
+                ++i;
+                continue;
+            }
+            size_t j = i;
+            while (j < count && mRuns[order[j]].mLevel >= level)
+            {
+                ++j;
+            }
+            std::reverse(order.data() + i, order.data() + j);
+            i = j;
+        }
     }
     
-    // Set paragraph direction to RTL for Arabic text
-    FriBidiParType base_dir = containsArabic(input) ? 
-                              FRIBIDI_PAR_RTL : FRIBIDI_PAR_LTR;
-    
-    // Get character types
-    fribidi_get_bidi_types(unicode_str.data(), length, bidi_types.data());
-    
-    // Get embedding levels
-    FriBidiLevel max_level = fribidi_get_par_embedding_levels(
-        bidi_types.data(), length, &base_dir, embedding_levels.data());
-    
-    if (max_level == 0)
+    // The glyphs of every run are already in visual order
+    size_t glyph_count = 0;
+    for (size_t i = 0; i < count; ++i)
     {
-        // No reordering needed
-        return input;
+        glyph_count += mRuns[order[i]].mGlyphCount;
+        line.mWidth += mRuns[order[i]].mWidth;
     }
-    
-    // Reorder the text
-    if (!fribidi_reorder_line(
-            FRIBIDI_FLAGS_DEFAULT,
-            bidi_types.data(), length,
-            0, base_dir,
-            embedding_levels.data(),
-            visual_str.data(),
-            positions_map.data()))
+    line.mText.reserve(glyph_count);
+    for (size_t i = 0; i < count; ++i)
     {
-        // Reordering failed, return original
-        return input;
+        const Run& run = mRuns[order[i]];
+        for (size_t g = run.mFirstGlyph; g < run.mFirstGlyph + run.mGlyphCount; ++g)
+        {
+            line.mText.push_back(static_cast<wchar_t>(mGlyphs[g].mCodepoint));
+        }
     }
+    lines.push_back(std::move(line));
+}
+
+//-----------------------------------------------------------------------------
+// LLArabicGlyphAtlas implementation
+//-----------------------------------------------------------------------------
+
+namespace
+{
+    // Blank pixels right of and below every run, so filtering a run
+    // uploaded with its page never picks up its neighbours
+    const int ATLAS_PADDING = 1;
     
-    // Convert back to wstring
-    std::wstring result;
-    result.reserve(length);
-    for (size_t i = 0; i < length; ++i)
+    // Rasterizes at a size of its own, leaving the size the viewer set on
+    // the face alone
+    class LLScopedFTSize
     {
-        result.push_back(static_cast<wchar_t>(visual_str[i]));
-    }
+    public:
+        LLScopedFTSize(FT_Face face, int pixel_size)
+            : mFace(face)
+            , mPrevious(face->size)
+            , mSize(nullptr)
+        {
+            if (FT_New_Size(face, &mSize) != 0)
+            {
+                mSize = nullptr;
+                return;
+            }
+            FT_Activate_Size(mSize);
+            if (FT_Set_Pixel_Sizes(face, 0, pixel_size) != 0)
+            {
+                release();
+            }
+        }
+        
+        ~LLScopedFTSize()
+        {
+            release();
+        }
+        
+        bool isValid() const { return mSize != nullptr; }
+        
+    private:
+        LLScopedFTSize(const LLScopedFTSize&) = delete;
+        LLScopedFTSize& operator=(const LLScopedFTSize&) = delete;
+        
+        void release()
+        {
+            if (mSize)
+            {
+                FT_Activate_Size(mPrevious);
+                FT_Done_Size(mSize);
+                mSize = nullptr;
+            }
+        }
+        
+        FT_Face mFace;
+        FT_Size mPrevious;
+        FT_Size mSize;
+    };
     
-    // Cache the result
-    if (mEnableCache)
+    inline unsigned char glyphCoverage(const FT_Bitmap& bitmap, unsigned int x, unsigned int y)
     {
-        cacheText(input, result);
+        const unsigned char* row = bitmap.pitch >= 0 ?
+            bitmap.buffer + y * bitmap.pitch :
+            bitmap.buffer + (bitmap.rows - 1 - y) * static_cast<unsigned int>(-bitmap.pitch);
+        switch (bitmap.pixel_mode)
+        {
+        case FT_PIXEL_MODE_GRAY:
+            return row[x];
+        case FT_PIXEL_MODE_MONO:
+            return ((row[x >> 3] >> (7 - (x & 7))) & 1) ? 255 : 0;
+        default:
+            return 0;   // Colour and LCD bitmaps are not drawn as coverage
+        }
     }
     
-    return result;
+    // Blends 8-bit coverage into a coverage bitmap with its top-left at (left, top)
+    void blendCoverage(const unsigned char* coverage, int coverage_width, int coverage_height,
+                       int left, int top, unsigned char* target, int width, int height, int stride)
+    {
+        int first_col = std::max(0, -left);
+        int last_col = std::min(coverage_width, width - left);
+        for (int row = std::max(0, -top); row < coverage_height && top + row < height; ++row)
+        {
+            const unsigned char* from = coverage + static_cast<size_t>(row) * coverage_width;
+            unsigned char* to = target + static_cast<ptrdiff_t>(top + row) * stride + left;
+            for (int col = first_col; col < last_col; ++col)
+            {
+                to[col] = std::max(to[col], from[col]);
+            }
+        }
+    }
 }
 
-std::wstring LLArabicSupport::shapeArabicText(const std::wstring& input)
+LLArabicGlyphAtlas::LLArabicGlyphAtlas(size_t pixel_budget)
+    : mFace(nullptr)
+    , mSpaceGlyph(0)
+    , mPixelBudget(pixel_budget)
+    , mPixels(0)
+    , mHits(0)
+    , mMisses(0)
+    , mEvictions(0)
+{
+}
+
+int LLArabicGlyphAtlas::drawText(std::wstring_view glyphs, int pixel_size, unsigned char* target,
+                                 int width, int height, int stride, int x, int y)
+{
+    return drawText(glyphs, nullptr, pixel_size, target, width, height, stride, x, y);
+}
+
+int LLArabicGlyphAtlas::drawText(std::wstring_view glyphs, const hb_glyph_position_t* positions,
+                                 int pixel_size, unsigned char* target, int width, int height,
+                                 int stride, int x, int y)
 {
-    if (input.empty() || !mInitialized || !mHBFont)
+    LL_ARABIC_TRACE_ZONE(zone, "drawText");
+    LL_ARABIC_TRACE_LENGTH(zone, glyphs.size());
+    
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mFace)
     {
-        return input;
+        mFace = LLArabicSupport::instance().getFTFace();
+        if (mFace)
+        {
+            mSpaceGlyph = FT_Get_Char_Index(mFace, ' ');
+        }
     }
-    
-    // Only shape if text contains Arabic
-    if (!containsArabic(input))
+    if (!mFace || pixel_size <= 0)
     {
-        return input;
+        return -1;
     }
     
-    // Clear HarfBuzz buffer
-    hb_buffer_clear_contents(mHBBuffer);
-    
-    // Add text to buffer
-    for (size_t i = 0; i < input.length(); ++i)
+    LLScratchBuffer<unsigned int> ids(glyphs.size());
+    for (size_t i = 0; i < glyphs.size(); ++i)
     {
-        hb_buffer_add(mHBBuffer, static_cast<hb_codepoint_t>(input[i]), i);
+        ids[i] = static_cast<unsigned int>(glyphs[i]);
     }
     
-    // Set buffer properties for Arabic
-    hb_buffer_set_direction(mHBBuffer, HB_DIRECTION_RTL);
-    hb_buffer_set_script(mHBBuffer, HB_SCRIPT_ARABIC);
-    hb_buffer_set_language(mHBBuffer, hb_language_from_string("ar", -1));
-    
-    // Guess segment properties if not set
-    hb_buffer_guess_segment_properties(mHBBuffer);
-    
-    // Shape the text
-    hb_shape(mHBFont, mHBBuffer, nullptr, 0);
-    
-    // Get glyph information
-    unsigned int glyph_count = 0;
-    hb_glyph_info_t* glyph_info = hb_buffer_get_glyph_infos(mHBBuffer, &glyph_count);
-    
-    if (glyph_count == 0)
+    // The parts of the positions that place a horizontal run
+    LLScratchBuffer<int> placement(positions ? glyphs.size() * 3 : 0);
+    for (size_t i = 0; positions && i < glyphs.size(); ++i)
     {
-        return input;
+        placement[i * 3] = positions[i].x_advance;
+        placement[i * 3 + 1] = positions[i].x_offset;
+        placement[i * 3 + 2] = positions[i].y_offset;
     }
     
-    // Build result string from glyphs
-    std::wstring result;
-    result.reserve(glyph_count);
-    
-    for (unsigned int i = 0; i < glyph_count; ++i)
+    // Runs of spaces and the words between them are cached separately, so
+    // a word is found again whatever it stands next to. The pen is kept in
+    // 26.6 so positioned runs do not gather rounding errors.
+    long pen = static_cast<long>(x) * 64;
+    size_t start = 0;
+    while (start < glyphs.size())
     {
-        // Note: In a real implementation, you would map glyph IDs to Unicode
-        // For now, we use the codepoint which HarfBuzz provides
-        result.push_back(static_cast<wchar_t>(glyph_info[i].codepoint));
+        bool space = ids[start] == mSpaceGlyph;
+        size_t end = start + 1;
+        while (end < glyphs.size() && (ids[end] == mSpaceGlyph) == space)
+        {
+            ++end;
+        }
+        pen += drawRun(ids.data() + start, positions ? placement.data() + start * 3 : nullptr,
+                       end - start, pixel_size, target, width, height, stride,
+                       static_cast<int>((pen + 32) >> 6), y);
+        start = end;
     }
-    
-    return result;
+    return static_cast<int>((pen + 32) >> 6) - x;
 }
 
-std::wstring LLArabicSupport::processArabicText(const std::wstring& input)
+// Returns the advance of the run in 26.6 fixed point
+long LLArabicGlyphAtlas::drawRun(const unsigned int* glyphs, const int* positions, size_t count,
+                                 int pixel_size, unsigned char* target, int width, int height,
+                                 int stride, int x, int y)
 {
-    if (input.empty())
+    size_t position_count = positions ? count * 3 : 0;
+    uint64_t hash = hashRun(glyphs, positions, count, pixel_size);
+    auto range = mIndex.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it)
     {
-        return input;
+        const Run& run = *it->second;
+        if (run.mPixelSize == pixel_size && run.mGlyphs.size() == count &&
+            std::equal(glyphs, glyphs + count, run.mGlyphs.begin()) &&
+            run.mPositions.size() == position_count &&
+            std::equal(positions, positions + position_count, run.mPositions.begin()))
+        {
+            mHits++;
+            mRuns.splice(mRuns.begin(), mRuns, it->second);
+            blit(run, target, width, height, stride, x, y);
+            return run.mAdvance;
+        }
     }
     
-    // Check if processing is needed
-    if (!containsArabic(input))
+    LL_ARABIC_TRACE_ZONE(zone, "rasterizeRun");
+    LL_ARABIC_TRACE_LENGTH(zone, count);
+    mMisses++;
+    LLScopedFTSize size(mFace, pixel_size);
+    if (!size.isValid())
     {
-        return input;
+        return 0;
     }
     
-    // Check cache
-    if (mEnableCache)
+    // Every glyph is rendered once; the box of the bitmaps is what the
+    // atlas holds
+    long advance = renderRun(glyphs, positions, count);
+    int left = INT_MAX;
+    int right = INT_MIN;
+    int top = INT_MIN;
+    int bottom = INT_MAX;
+    for (const GlyphBitmap& bitmap : mBitmaps)
     {
-        std::wstring cached = getCachedText(L"FULL:" + input);
-        if (!cached.empty())
-        {
-            mCacheHits++;
-            return cached;
-        }
-        mCacheMisses++;
+        left = std::min(left, bitmap.mLeft);
+        right = std::max(right, bitmap.mLeft + bitmap.mWidth);
+        top = std::max(top, bitmap.mTop);
+        bottom = std::min(bottom, bitmap.mTop - bitmap.mHeight);
     }
     
-    // Step 1: Reorder bidirectional text
-    std::wstring reordered = reorderBidiText(input);
+    Run run;
+    run.mHash = hash;
+    run.mGlyphs.assign(glyphs, glyphs + count);
+    run.mPositions.assign(positions, positions + position_count);
+    run.mPixelSize = pixel_size;
+    run.mPage = NO_PAGE;
+    run.mX = run.mY = 0;
+    run.mShelf = 0;
+    run.mAdvance = advance;
+    bool empty = left >= right;
+    run.mLeft = empty ? 0 : left;
+    run.mTop = empty ? 0 : top;
+    run.mWidth = empty ? 0 : right - left;
+    run.mHeight = empty ? 0 : top - bottom;
     
-    // Step 2: Shape Arabic characters
-    std::wstring shaped = shapeArabicText(reordered);
+    if (!allocate(run))
+    {
+        // Larger than a page: drawn straight into the target every time
+        for (const GlyphBitmap& bitmap : mBitmaps)
+        {
+            blendCoverage(mCoverage.data() + bitmap.mOffset, bitmap.mWidth, bitmap.mHeight,
+                          x + bitmap.mLeft, y - bitmap.mTop, target, width, height, stride);
+        }
+        return run.mAdvance;
+    }
     
-    // Cache the final result
-    if (mEnableCache)
+    if (run.mPage != NO_PAGE)
     {
-        cacheText(L"FULL:" + input, shaped);
+        unsigned char* slot = mPages[run.mPage].mPixels.get() +
+                              static_cast<size_t>(run.mY) * PAGE_SIZE + run.mX;
+        for (const GlyphBitmap& bitmap : mBitmaps)
+        {
+            blendCoverage(mCoverage.data() + bitmap.mOffset, bitmap.mWidth, bitmap.mHeight,
+                          bitmap.mLeft - run.mLeft, run.mTop - bitmap.mTop,
+                          slot, run.mWidth, run.mHeight, PAGE_SIZE);
+        }
     }
     
-    return shaped;
+    mPixels += static_cast<size_t>(run.mWidth) * run.mHeight;
+    mRuns.push_front(std::move(run));
+    mIndex.emplace(hash, mRuns.begin());
+    blit(mRuns.front(), target, width, height, stride, x, y);
+    return mRuns.front().mAdvance;
 }
 
-void LLArabicSupport::clearCache()
+// Renders the glyphs of a run with the pen starting at 0 into mBitmaps and
+// returns the advance in 26.6 fixed point. Glyphs are placed by their
+// positions if given, else by their FreeType advances. Glyphs the font does
+// not have are left out.
+long LLArabicGlyphAtlas::renderRun(const unsigned int* glyphs, const int* positions, size_t count)
 {
-    mProcessedTextCache.clear();
-    mCacheHits = 0;
-    mCacheMisses = 0;
+    mBitmaps.clear();
+    mCoverage.clear();
+    long pen = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const int* position = positions ? positions + i * 3 : nullptr;
+        if (FT_Load_Glyph(mFace, glyphs[i], FT_LOAD_RENDER) != 0)
+        {
+            pen += position ? position[0] : 0;
+            continue;
+        }
+        FT_GlyphSlot slot = mFace->glyph;
+        const FT_Bitmap& bitmap = slot->bitmap;
+        if (bitmap.width > 0 && bitmap.rows > 0)
+        {
+            long origin_x = position ? pen + position[1] : pen;
+            long origin_y = position ? position[2] : 0;
+            GlyphBitmap glyph;
+            glyph.mOffset = mCoverage.size();
+            glyph.mLeft = static_cast<int>((origin_x + 32) >> 6) + slot->bitmap_left;
+            glyph.mTop = static_cast<int>((origin_y + 32) >> 6) + slot->bitmap_top;
+            glyph.mWidth = static_cast<int>(bitmap.width);
+            glyph.mHeight = static_cast<int>(bitmap.rows);
+            mCoverage.resize(glyph.mOffset + static_cast<size_t>(bitmap.width) * bitmap.rows);
+            unsigned char* coverage = mCoverage.data() + glyph.mOffset;
+            for (unsigned int row = 0; row < bitmap.rows; ++row)
+            {
+                for (unsigned int col = 0; col < bitmap.width; ++col)
+                {
+                    *coverage++ = glyphCoverage(bitmap, col, row);
+                }
+            }
+            mBitmaps.push_back(glyph);
+        }
+        pen += position ? position[0] : slot->advance.x;
+    }
+    return pen;
 }
 
-void LLArabicSupport::getCacheStats(size_t& cache_size, size_t& hit_count, 
-                                    size_t& miss_count) const
+bool LLArabicGlyphAtlas::allocate(Run& run)
 {
-    cache_size = mProcessedTextCache.size();
-    hit_count = mCacheHits;
-    miss_count = mCacheMisses;
+    if (run.mWidth == 0)
+    {
+        return true;
+    }
+    if (run.mWidth + ATLAS_PADDING > PAGE_SIZE || run.mHeight + ATLAS_PADDING > PAGE_SIZE)
+    {
+        return false;
+    }
+    
+    const size_t page_pixels = static_cast<size_t>(PAGE_SIZE) * PAGE_SIZE;
+    while (true)
+    {
+        for (size_t i = 0; i < mPages.size(); ++i)
+        {
+            if (allocateInPage(i, run))
+            {
+                return true;
+            }
+        }
+        
+        // A new page while the budget allows, otherwise make room by
+        // dropping the least recently drawn runs
+        if (mPages.empty() || (mPages.size() + 1) * page_pixels <= mPixelBudget)
+        {
+            Page page;
+            page.mPixels.reset(new unsigned char[page_pixels]);
+            page.mUsedHeight = 0;
+            page.mRuns = 0;
+            mPages.push_back(std::move(page));
+        }
+        else if (!mRuns.empty())
+        {
+            evictLeastRecent();
+        }
+        else
+        {
+            return false;
+        }
+    }
 }
 
-std::wstring LLArabicSupport::getCachedText(const std::wstring& key) const
+bool LLArabicGlyphAtlas::allocateInPage(size_t page_index, Run& run)
 {
-    auto it = mProcessedTextCache.find(key);
-    if (it != mProcessedTextCache.end())
+    Page& page = mPages[page_index];
+    int width = run.mWidth + ATLAS_PADDING;
+    int height = run.mHeight + ATLAS_PADDING;
+    
+    // The lowest shelf the run fits on, not wasting much more than its
+    // height; failing that a new shelf, then any empty one
+    size_t best = page.mShelves.size();
+    for (size_t i = 0; i < page.mShelves.size(); ++i)
+    {
+        const Shelf& shelf = page.mShelves[i];
+        if (shelf.mHeight >= height && shelf.mHeight <= height * 2 &&
+            shelf.mUsed + width <= PAGE_SIZE &&
+            (best == page.mShelves.size() || shelf.mHeight < page.mShelves[best].mHeight))
+        {
+            best = i;
+        }
+    }
+    if (best == page.mShelves.size())
+    {
+        if (page.mUsedHeight + height <= PAGE_SIZE)
+        {
+            page.mShelves.push_back(Shelf{ page.mUsedHeight, height, 0, 0 });
+            page.mUsedHeight += height;
+        }
+        else
+        {
+            for (best = 0; best < page.mShelves.size(); ++best)
+            {
+                if (page.mShelves[best].mRuns == 0 && page.mShelves[best].mHeight >= height)
+                {
+                    break;
+                }
+            }
+            if (best == page.mShelves.size())
+            {
+                return false;
+            }
+        }
+    }
+    
+    Shelf& shelf = page.mShelves[best];
+    run.mPage = page_index;
+    run.mShelf = best;
+    run.mX = shelf.mUsed;
+    run.mY = shelf.mY;
+    shelf.mUsed += width;
+    shelf.mRuns++;
+    page.mRuns++;
+    
+    // The slot may hold pixels of evicted runs
+    for (int row = 0; row < height; ++row)
     {
-        return it->second;
+        std::fill_n(page.mPixels.get() + static_cast<size_t>(run.mY + row) * PAGE_SIZE + run.mX,
+                    width, 0);
     }
-    return std::wstring();
+    return true;
 }
 
-void LLArabicSupport::cacheText(const std::wstring& key, const std::wstring& value)
+void LLArabicGlyphAtlas::evictLeastRecent()
 {
-    // Check if we need to limit cache size
-    if (mMaxCacheSize > 0 && mProcessedTextCache.size() >= mMaxCacheSize)
+    const Run& run = mRuns.back();
+    if (run.mPage != NO_PAGE)
     {
-        limitCacheSize();
+        Page& page = mPages[run.mPage];
+        Shelf& shelf = page.mShelves[run.mShelf];
+        if (--shelf.mRuns == 0)
+        {
+            shelf.mUsed = 0;
+        }
+        page.mRuns--;
+        
+        // Empty shelves at the bottom give their height back
+        while (!page.mShelves.empty() && page.mShelves.back().mRuns == 0)
+        {
+            page.mUsedHeight = page.mShelves.back().mY;
+            page.mShelves.pop_back();
+        }
     }
     
-    mProcessedTextCache[key] = value;
+    auto range = mIndex.equal_range(run.mHash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        if (&*it->second == &run)
+        {
+            mIndex.erase(it);
+            break;
+        }
+    }
+    mPixels -= static_cast<size_t>(run.mWidth) * run.mHeight;
+    mEvictions++;
+    mRuns.pop_back();
 }
 
-void LLArabicSupport::limitCacheSize()
+void LLArabicGlyphAtlas::blit(const Run& run, unsigned char* target, int width, int height,
+                              int stride, int x, int y) const
 {
-    // Simple strategy: remove oldest entries (first 25%)
-    if (mProcessedTextCache.empty())
+    if (run.mPage == NO_PAGE)
     {
         return;
     }
     
-    size_t to_remove = mProcessedTextCache.size() / 4;
-    if (to_remove == 0)
+    int left = x + run.mLeft;
+    int top = y - run.mTop;
+    int first_col = std::max(0, -left);
+    int last_col = std::min(run.mWidth, width - left);
+    const unsigned char* source = mPages[run.mPage].mPixels.get() +
+                                  static_cast<size_t>(run.mY) * PAGE_SIZE + run.mX;
+    for (int row = std::max(0, -top); row < run.mHeight && top + row < height; ++row)
+    {
+        const unsigned char* from = source + static_cast<size_t>(row) * PAGE_SIZE;
+        unsigned char* to = target + static_cast<ptrdiff_t>(top + row) * stride + left;
+        for (int col = first_col; col < last_col; ++col)
+        {
+            to[col] = std::max(to[col], from[col]);
+        }
+    }
+}
+
+uint64_t LLArabicGlyphAtlas::hashRun(const unsigned int* glyphs, const int* positions, size_t count,
+                                     int pixel_size)
+{
+    uint64_t hash = LLArabicTextCache::HASH_SEED ^ static_cast<uint32_t>(pixel_size);
+    for (size_t i = 0; i < count; ++i)
     {
-        to_remove = 1;
+        hash = (hash ^ glyphs[i]) * 0x100000001b3ULL;
     }
-    
-    auto it = mProcessedTextCache.begin();
-    for (size_t i = 0; i < to_remove && it != mProcessedTextCache.end(); ++i)
+    for (size_t i = 0; positions && i < count * 3; ++i)
     {
-        it = mProcessedTextCache.erase(it);
+        hash = (hash ^ static_cast<uint32_t>(positions[i])) * 0x100000001b3ULL;
     }
+    return hash;
+}
+
+void LLArabicGlyphAtlas::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mIndex.clear();
+    mRuns.clear();
+    mPages.clear();
+    mPixels = 0;
+}
+
+void LLArabicGlyphAtlas::getStats(Stats& stats) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    stats.mRuns = mRuns.size();
+    stats.mPixels = mPixels;
+    stats.mPages = mPages.size();
+    stats.mHits = mHits;
+    stats.mMisses = mMisses;
+    stats.mEvictions = mEvictions;
 }
 
 //-----------------------------------------------------------------------------
@@ -368,6 +4171,9 @@ namespace LLArabicUtil
 {
     std::wstring utf8_to_wstring(const std::string& str)
     {
+        LL_ARABIC_TRACE_ZONE(zone, "utf8_to_wstring");
+        LL_ARABIC_TRACE_LENGTH(zone, str.size());
+        
         if (str.empty())
         {
             return std::wstring();
@@ -387,6 +4193,9 @@ namespace LLArabicUtil
     
     std::string wstring_to_utf8(const std::wstring& wstr)
     {
+        LL_ARABIC_TRACE_ZONE(zone, "wstring_to_utf8");
+        LL_ARABIC_TRACE_LENGTH(zone, wstr.size());
+        
         if (wstr.empty())
         {
             return std::string();
@@ -406,12 +4215,19 @@ namespace LLArabicUtil
     
     bool needsArabicProcessing(const std::string& str)
     {
+        LL_ARABIC_TRACE_ZONE(zone, "needsArabicProcessing");
+        LL_ARABIC_TRACE_LENGTH(zone, str.size());
+        
         std::wstring wstr = utf8_to_wstring(str);
         return LLArabicSupport::instance().containsArabic(wstr);
     }
     
-    std::string processArabicString(const std::string& str)
+    std::string processArabicString(const std::string& str,
+                                    LLArabicSupport::ECachePool pool)
     {
+        LL_ARABIC_TRACE_ZONE(zone, "processArabicString");
+        LL_ARABIC_TRACE_LENGTH(zone, str.size());
+        
         if (str.empty())
         {
             return str;
@@ -421,7 +4237,7 @@ namespace LLArabicUtil
         std::wstring wstr = utf8_to_wstring(str);
         
         // Process
-        std::wstring processed = LLArabicSupport::instance().processArabicText(wstr);
+        std::wstring processed = LLArabicSupport::instance().processArabicText(wstr, pool);
         
         // Convert back to UTF-8
         return wstring_to_utf8(processed);
@@ -23,14 +23,27 @@
 #define LL_LLARABICSUPPORT_H
 
 #include <string>
+#include <string_view>
 #include <vector>
-#include <map>
 #include <memory>
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
 
 // Forward declarations for external libraries
 typedef struct hb_buffer_t hb_buffer_t;
+typedef struct hb_face_t hb_face_t;
 typedef struct hb_font_t hb_font_t;
+typedef struct hb_glyph_position_t hb_glyph_position_t;
 typedef struct FT_FaceRec_* FT_Face;
+typedef struct FT_LibraryRec_* FT_Library;
+
+// Internal implementation classes (llarabicsupport.cpp)
+class LLArabicTextCache;
+class LLArabicSharedCache;
+struct LLArabicTextAnalysis;
 
 /**
  * @class LLArabicSupport
@@ -41,33 +54,166 @@ typedef struct FT_FaceRec_* FT_Face;
  * - Bidirectional text reordering (RTL/LTR)
  * - Arabic text shaping (connecting letters)
  * - Mixed Arabic/English text processing
+ *
+ * Text processing may be called from several threads at once. Cache
+ * lookups take no lock; initialize() should complete before other threads
+ * start processing text.
  */
 class LLArabicSupport
 {
 public:
+    /**
+     * Cache pools. Long-lived strings (UI labels, display names) and
+     * transient strings (chat lines) get separate budgets, so a flood of
+     * one-off chat cannot push stable labels out of the cache.
+     */
+    enum ECachePool
+    {
+        CACHE_POOL_UI = 0,      // UI labels, display names, region names
+        CACHE_POOL_CHAT,        // Chat lines, IMs and other transient text
+        CACHE_POOL_COUNT
+    };
+    
+    /**
+     * Default cache budget in bytes, split evenly between the pools
+     */
+    static constexpr size_t DEFAULT_CACHE_SIZE = 1024 * 1024;
+    
+    /**
+     * Default size of a new shared cache segment in bytes
+     */
+    static constexpr size_t DEFAULT_SHARED_CACHE_SIZE = 4 * 1024 * 1024;
+    
+    /**
+     * Cache statistics, per pool. Shaped runs reused across lines count
+     * towards the pool's entries and bytes, but have their own hit and
+     * miss counters. The shared cache counters are this process's lookups
+     * of the segment, for all pools.
+     */
+    struct CacheStats
+    {
+        size_t mEntries[CACHE_POOL_COUNT];
+        size_t mBytes[CACHE_POOL_COUNT];        // Held by the pool's entries
+        size_t mCapacity[CACHE_POOL_COUNT];     // Bytes, 0 = unlimited
+        size_t mHits[CACHE_POOL_COUNT];
+        size_t mLocalHits[CACHE_POOL_COUNT];    // Part of mHits served by the thread-local L1
+        size_t mMisses[CACHE_POOL_COUNT];
+        size_t mRunHits[CACHE_POOL_COUNT];      // Word runs of new lines found already shaped
+        size_t mRunMisses[CACHE_POOL_COUNT];    // Word runs that went through HarfBuzz
+        size_t mEvictions[CACHE_POOL_COUNT];
+        size_t mRejected[CACHE_POOL_COUNT];     // Refused by the admission filter
+        size_t mSlabBytes;                      // Allocated for all pools, including holes
+        size_t mSharedHits;                     // Private misses found in the shared cache
+        size_t mSharedMisses;
+        size_t mSharedCorrupt;                  // Shared entries that failed their checksum
+    };
+    
+    /**
+     * Processed text borrowed from the cache without copying. The text
+     * stays valid while this object holds it, which holds back cache
+     * reclamation: keep it short-lived (one draw call) and release it on
+     * the thread that obtained it.
+     */
+    class CachedText
+    {
+    public:
+        CachedText() : mPinned(false) {}
+        ~CachedText() { release(); }
+        
+        std::wstring_view text() const { return mText; }
+        void release();
+        
+    private:
+        friend class LLArabicSupport;
+        CachedText(const CachedText&) = delete;
+        CachedText& operator=(const CachedText&) = delete;
+        
+        std::wstring_view mText;
+        bool mPinned;
+    };
+    
     /**
      * Get singleton instance
      */
     static LLArabicSupport& instance();
     
     /**
-     * Initialize with a font face (must be called before shaping)
+     * Initialize with a font face (must be called before shaping). The
+     * HarfBuzz font is created from it with the first Arabic text.
      * @param font_face FreeType font face
      * @return true if successful
      */
     bool initialize(FT_Face font_face);
     
+    /**
+     * Initialize with a font file (must be called before shaping). Nothing
+     * is read until the first text that contains Arabic; the file is then
+     * memory-mapped and HarfBuzz reads font tables from it on demand, so
+     * sessions without Arabic text never pay for the font.
+     * @param font_path Path to the font file (e.g. NotoSansArabic-Regular.ttf)
+     * @return false (and a warning in the log) if the file is missing or
+     *         cannot be read
+     */
+    bool initialize(const std::string& font_path);
+    
     /**
      * Check if initialized
      */
     bool isInitialized() const { return mInitialized; }
     
+    /**
+     * Check if the font has been loaded (happens with the first Arabic text)
+     */
+    bool isFontLoaded() const;
+    
     /**
      * Process Arabic text completely (reorder + shape)
      * @param input Input text (may contain mixed Arabic/English)
+     * @param pool Cache pool the text belongs to
      * @return Processed text ready for display
      */
-    std::wstring processArabicText(const std::wstring& input);
+    std::wstring processArabicText(const std::wstring& input,
+                                   ECachePool pool = CACHE_POOL_UI);
+    
+    /**
+     * Process a document of several paragraphs (notecards, profiles).
+     * Paragraphs are split on paragraph separators, reordered and shaped
+     * independently (in parallel for long documents) and cached one by
+     * one, so editing a paragraph only reprocesses that paragraph.
+     * processArabicText() takes this path for multi-paragraph input too.
+     * @param input Input text
+     * @param pool Cache pool the paragraphs belong to
+     * @return Processed text with the original paragraph separators
+     */
+    std::wstring processArabicDocument(const std::wstring& input,
+                                       ECachePool pool = CACHE_POOL_UI);
+    
+    /**
+     * Process text into a caller-provided buffer. Does not allocate on a
+     * cache hit, nor on a miss for short text, paragraph separators
+     * included (documents long enough to be processed in parallel do).
+     * @param input Input text
+     * @param output Destination buffer
+     * @param capacity Size of output in characters
+     * @param pool Cache pool the text belongs to
+     * @return Length of the processed text. If it is larger than capacity
+     *         the text did not fit (the buffer may hold part of it); retry
+     *         with a buffer of that size.
+     */
+    size_t processArabicText(std::wstring_view input, wchar_t* output, size_t capacity,
+                             ECachePool pool = CACHE_POOL_UI);
+    
+    /**
+     * Get processed text without copying, for the render loop
+     * @param input Input text
+     * @param text Receives the processed text (input itself if it needs
+     *        no processing)
+     * @param pool Cache pool the text belongs to
+     * @return false if the text is not cached yet and has to go through
+     *         processArabicText()
+     */
+    bool findProcessedText(std::wstring_view input, CachedText& text,
+                           ECachePool pool = CACHE_POOL_UI);
     
     /**
      * Shape Arabic text (connect letters)
@@ -77,18 +223,20 @@ public:
     std::wstring shapeArabicText(const std::wstring& input);
     
     /**
-     * Reorder bidirectional text (handle RTL/LTR)
+     * Reorder bidirectional text (handle RTL/LTR), paragraph by paragraph
      * @param input Input text
+     * @param pool Cache pool the text belongs to
      * @return Reordered text
      */
-    std::wstring reorderBidiText(const std::wstring& input);
+    std::wstring reorderBidiText(const std::wstring& input,
+                                 ECachePool pool = CACHE_POOL_UI);
     
     /**
      * Check if text contains Arabic characters
      * @param text Text to check
      * @return true if contains Arabic
      */
-    bool containsArabic(const std::wstring& text) const;
+    bool containsArabic(std::wstring_view text) const;
     
     /**
      * Check if a character is Arabic
@@ -108,7 +256,7 @@ public:
      * Enable/disable caching
      * @param enable true to enable caching
      */
-    void setEnableCache(bool enable) { mEnableCache = enable; }
+    void setEnableCache(bool enable);
     
     /**
      * Clear text cache
@@ -121,12 +269,70 @@ public:
     void getCacheStats(size_t& cache_size, size_t& hit_count, size_t& miss_count) const;
     
     /**
-     * Set maximum cache size
-     * @param max_size Maximum number of cached entries (0 = unlimited)
+     * Get detailed cache statistics for every pool
+     */
+    void getCacheStats(CacheStats& stats) const;
+    
+    /**
+     * Set maximum cache size, split evenly between the pools
+     * @param max_size Maximum cache memory in bytes (0 = unlimited)
+     */
+    void setMaxCacheSize(size_t max_size);
+    
+    /**
+     * Set maximum cache size of a single pool
+     * @param pool Cache pool
+     * @param max_size Maximum memory of the pool in bytes (0 = unlimited)
+     */
+    void setPoolCacheSize(ECachePool pool, size_t max_size);
+    
+    /**
+     * Release cache memory when the viewer runs low on memory: the colder
+     * half of every pool is dropped and the space it held is freed
+     */
+    void handleMemoryPressure();
+    
+    /**
+     * Share processed text with the other viewer instances on this machine
+     * through a POSIX shared memory segment, behind the private cache. The
+     * first instance creates the segment and the others attach to it;
+     * entries are keyed by text and font, so instances with different
+     * fonts never see each other's glyphs. Needs a build with
+     * LL_ARABIC_SHARED_CACHE. The segment outlives the viewers until it is
+     * unlinked (/dev/shm on Linux) or the machine restarts.
+     * @param name Segment name, e.g. "/sela_arabic_cache"
+     * @param max_size Size of a new segment in bytes; an existing segment
+     *        keeps its own size
+     * @return false if the segment could not be opened or failed
+     *         validation; the private cache is then used on its own
+     */
+    bool openSharedCache(const std::string& name,
+                         size_t max_size = DEFAULT_SHARED_CACHE_SIZE);
+    
+    /**
+     * Stop using the shared cache. The segment is left for the other
+     * instances.
+     */
+    void closeSharedCache();
+    
+    /**
+     * Start writing a Chrome trace-event file (chrome://tracing, Perfetto)
+     * with a zone for every pipeline stage. Needs a build with
+     * LL_ARABIC_TRACING; otherwise nothing is written.
+     * @param filename Output JSON file
+     * @return true if tracing started
+     */
+    static bool startTrace(const std::string& filename);
+    
+    /**
+     * Stop tracing and close the trace file
      */
-    void setMaxCacheSize(size_t max_size) { mMaxCacheSize = max_size; }
+    static void stopTrace();
 
 private:
+    friend class LLArabicTextLayout;
+    friend class LLArabicGlyphAtlas;
+    
     LLArabicSupport();
     ~LLArabicSupport();
     
@@ -134,24 +340,292 @@ private:
     LLArabicSupport(const LLArabicSupport&) = delete;
     LLArabicSupport& operator=(const LLArabicSupport&) = delete;
     
-    // HarfBuzz objects
-    hb_buffer_t* mHBBuffer;
+    // Font source and the HarfBuzz objects created from it on first use
+    // (shaping buffers are per thread)
+    FT_Face mFTFace;
+    std::string mFontPath;
+    FT_Library mFTLibrary;      // Only for a face opened from mFontPath
+    bool mOwnsFTFace;
+    hb_face_t* mHBFace;
     hb_font_t* mHBFont;
+    std::atomic<bool> mFontLoaded;
     
     // Initialization flag
-    bool mInitialized;
+    std::atomic<bool> mInitialized;
+    std::mutex mInitMutex;
     
-    // Caching system
-    bool mEnableCache;
-    size_t mMaxCacheSize;
-    std::map<std::wstring, std::wstring> mProcessedTextCache;
-    size_t mCacheHits;
-    size_t mCacheMisses;
+    // Caching system, created with the first Arabic text
+    std::atomic<bool> mEnableCache;
+    std::atomic<LLArabicTextCache*> mTextCache;
+    size_t mPoolCacheSize[CACHE_POOL_COUNT];
+    std::atomic<LLArabicSharedCache*> mSharedCache;
+    std::atomic<uint64_t> mFontIdentity;    // Keys shared entries; 0 until computed
     
     // Helper methods
-    void limitCacheSize();
-    std::wstring getCachedText(const std::wstring& key) const;
-    void cacheText(const std::wstring& key, const std::wstring& value);
+    hb_font_t* getFont();
+    void loadFont();
+    FT_Face getFTFace();
+    LLArabicTextCache* getTextCache();
+    LLArabicSharedCache* getSharedCache(uint64_t& font_identity);
+    size_t processText(std::wstring_view input, ECachePool pool,
+                       wchar_t* output, size_t capacity, std::wstring* overflow);
+    size_t processDocument(std::wstring_view input, ECachePool pool,
+                           wchar_t* output, size_t capacity, std::wstring* overflow);
+    void reorderText(const LLArabicTextAnalysis& analysis, LLArabicTextCache* cache,
+                     ECachePool pool, wchar_t* output, int* logical_index = nullptr);
+    size_t shapeText(std::wstring_view input, const LLArabicTextAnalysis& analysis);
+    bool shapeRuns(std::wstring_view input, const int* logical_index,
+                   const LLArabicTextAnalysis& analysis, LLArabicTextCache* cache, ECachePool pool,
+                   wchar_t* output, size_t capacity, size_t& glyph_count);
+    void copyShapedGlyphs(wchar_t* output, size_t glyph_count);
+    static size_t emitText(std::wstring_view text, wchar_t* output, size_t capacity,
+                           std::wstring* overflow);
+};
+
+/**
+ * @class LLArabicTextLayout
+ * @brief Text wrapped to a width, for chat bubbles and resizable floaters
+ *
+ * The text is analysed once: paragraphs, break opportunities, embedding
+ * levels and the shaped advances of every run. wrap() only walks that
+ * data, so re-wrapping on resize neither reshapes nor reruns the bidi
+ * algorithm. Each line is reordered with its paragraph's embedding levels
+ * (UAX #9 rules L1 and L2 per line), so a word keeps its place in the
+ * paragraph's direction whichever line it lands on.
+ */
+class LLArabicTextLayout
+{
+public:
+    struct Line
+    {
+        size_t mStart;          // First character of the line in the input
+        size_t mLength;         // Characters, including trailing spaces
+        float mWidth;           // Pixels, without trailing spaces
+        std::wstring mText;     // Shaped text in visual order, without trailing spaces
+    };
+    
+    /**
+     * Analyse text for wrapping. Paragraphs with Arabic are shaped with
+     * the Arabic font, which they load if needed; in other paragraphs, and
+     * without a font, every character is half an em wide.
+     * @param text Input text; paragraph separators force a line break
+     * @param font_size Font size in pixels
+     */
+    LLArabicTextLayout(std::wstring_view text, float font_size);
+    
+    /**
+     * Break the text into lines
+     * @param width Available width in pixels. A word wider than this
+     *        gets a line of its own.
+     * @param lines Receives the lines, top to bottom
+     */
+    void wrap(float width, std::vector<Line>& lines) const;
+    
+    /**
+     * Width of the widest paragraph when not wrapped
+     */
+    float getNaturalWidth() const { return mNaturalWidth; }
+    
+private:
+    struct Glyph
+    {
+        unsigned int mCodepoint;
+        float mAdvance;
+    };
+    
+    // Characters of one word (or of the spaces after it) at one embedding
+    // level; its glyphs are stored in visual order
+    struct Run
+    {
+        size_t mStart;
+        size_t mLength;
+        size_t mFirstGlyph;
+        size_t mGlyphCount;
+        float mWidth;
+        unsigned char mLevel;
+        bool mSpace;
+    };
+    
+    // A word and the spaces after it; lines may break after any segment
+    struct Segment
+    {
+        size_t mFirstRun;
+        size_t mRunCount;
+        float mWidth;           // Without the trailing spaces
+        float mSpaceWidth;
+    };
+    
+    struct Paragraph
+    {
+        size_t mStart;
+        size_t mFirstSegment;
+        size_t mSegmentCount;
+        unsigned char mBaseLevel;
+    };
+    
+    void analyseParagraph(std::wstring_view text, size_t start);
+    float addRuns(std::wstring_view text, size_t start, size_t end, size_t offset,
+                  const unsigned char* levels, bool space, hb_font_t* font);
+    void appendLine(const Paragraph& paragraph, size_t first_segment, size_t end_segment,
+                    std::vector<Line>& lines) const;
+    
+    float mFontSize;
+    float mNaturalWidth;
+    std::vector<Glyph> mGlyphs;
+    std::vector<Run> mRuns;
+    std::vector<Segment> mSegments;
+    std::vector<Paragraph> mParagraphs;
+};
+
+/**
+ * @class LLArabicGlyphAtlas
+ * @brief Rasterized shaped runs, for drawing repeated words with one blit
+ *
+ * Shaped text is split into runs at spaces, and every run (a joined Arabic
+ * word, say) is rasterized whole with FreeType into a packed 8-bit coverage
+ * atlas. Runs are keyed by font, pixel size, glyph sequence and glyph
+ * positions, so a word drawn again at the same size is copied from the
+ * atlas instead of being rendered glyph by glyph. Glyphs are placed by the
+ * HarfBuzz positions given with them, so mark offsets and kerning are kept;
+ * without positions they are placed by their hinted FreeType advances, as
+ * the per-glyph renderer places them. The least recently drawn runs are
+ * evicted when the atlas reaches its pixel budget.
+ *
+ * FreeType faces are not thread-safe: draw from the thread that renders
+ * text with the face given to LLArabicSupport::initialize().
+ */
+class LLArabicGlyphAtlas
+{
+public:
+    static constexpr int PAGE_SIZE = 512;                   // Pixels along each side
+    static constexpr size_t DEFAULT_PIXEL_BUDGET = 4 * PAGE_SIZE * PAGE_SIZE;
+    
+    struct Stats
+    {
+        size_t mRuns;               // Runs in the atlas
+        size_t mPixels;             // Covered by those runs
+        size_t mPages;
+        size_t mHits;
+        size_t mMisses;
+        size_t mEvictions;
+    };
+    
+    /**
+     * @param pixel_budget Most pixels of atlas pages to keep (one byte each)
+     */
+    explicit LLArabicGlyphAtlas(size_t pixel_budget = DEFAULT_PIXEL_BUDGET);
+    
+    /**
+     * Draw shaped text into an 8-bit coverage bitmap, blending by maximum
+     * @param glyphs Glyph indices in visual order, as processArabicText()
+     *        and LLArabicTextLayout return them for shaped text
+     * @param pixel_size Font size in pixels
+     * @param target Top-left of the bitmap
+     * @param width Width of the bitmap in pixels
+     * @param height Height of the bitmap in pixels
+     * @param stride Bytes per row of the bitmap
+     * @param x Pen position: left end of the baseline, may be outside the bitmap
+     * @param y Pen position: baseline row
+     * @return Advance of the text in pixels, or -1 without a font
+     */
+    int drawText(std::wstring_view glyphs, int pixel_size, unsigned char* target,
+                 int width, int height, int stride, int x, int y);
+    
+    /**
+     * Draw shaped text placed by its HarfBuzz positions
+     * @param positions One per glyph, as hb_buffer_get_glyph_positions()
+     *        returns them, in 26.6 pixels at pixel_size (the units of an
+     *        hb_ft font whose face is set to that size). Advances, x and y
+     *        offsets are used.
+     * @return Advance of the text in pixels, or -1 without a font
+     * @see drawText() for the other parameters
+     */
+    int drawText(std::wstring_view glyphs, const hb_glyph_position_t* positions, int pixel_size,
+                 unsigned char* target, int width, int height, int stride, int x, int y);
+    
+    /**
+     * Drop every run and free the pages
+     */
+    void clear();
+    
+    void getStats(Stats& stats) const;
+    
+private:
+    // Where a run was rasterized: its box in a page, relative to the pen
+    struct Run
+    {
+        uint64_t mHash;
+        std::vector<unsigned int> mGlyphs;
+        // 26.6 advance, x and y offset of each glyph; empty when placed by FreeType
+        std::vector<int> mPositions;
+        int mPixelSize;
+        size_t mPage;               // NO_PAGE if the run has no pixels (spaces)
+        int mX;
+        int mY;
+        int mWidth;
+        int mHeight;
+        int mLeft;                  // Left edge from the pen
+        int mTop;                   // Top edge above the baseline
+        long mAdvance;              // 26.6
+        size_t mShelf;
+    };
+    
+    typedef std::list<Run> RunList;
+    
+    // A glyph of the run being rasterized: its coverage in mCoverage, its
+    // left edge from the pen and its top above the baseline
+    struct GlyphBitmap
+    {
+        size_t mOffset;
+        int mLeft;
+        int mTop;
+        int mWidth;
+        int mHeight;
+    };
+    
+    // Row of runs in a page; reused once every run in it is gone
+    struct Shelf
+    {
+        int mY;
+        int mHeight;
+        int mUsed;
+        size_t mRuns;
+    };
+    
+    struct Page
+    {
+        std::unique_ptr<unsigned char[]> mPixels;
+        std::vector<Shelf> mShelves;
+        int mUsedHeight;
+        size_t mRuns;
+    };
+    
+    static const size_t NO_PAGE = ~size_t(0);
+    
+    long drawRun(const unsigned int* glyphs, const int* positions, size_t count, int pixel_size,
+                 unsigned char* target, int width, int height, int stride, int x, int y);
+    long renderRun(const unsigned int* glyphs, const int* positions, size_t count);
+    bool allocate(Run& run);
+    bool allocateInPage(size_t page_index, Run& run);
+    void evictLeastRecent();
+    void blit(const Run& run, unsigned char* target, int width, int height, int stride,
+              int x, int y) const;
+    static uint64_t hashRun(const unsigned int* glyphs, const int* positions, size_t count,
+                            int pixel_size);
+    
+    mutable std::mutex mMutex;
+    FT_Face mFace;                  // Fixed by initialize(), so not part of the key
+    unsigned int mSpaceGlyph;
+    size_t mPixelBudget;
+    std::vector<Page> mPages;
+    RunList mRuns;                                          // Most recently drawn first
+    std::unordered_multimap<uint64_t, RunList::iterator> mIndex;
+    size_t mPixels;
+    size_t mHits;
+    size_t mMisses;
+    size_t mEvictions;
+    std::vector<GlyphBitmap> mBitmaps;                      // Scratch for renderRun()
+    std::vector<unsigned char> mCoverage;
 };
 
 /**
@@ -179,9 +653,11 @@ namespace LLArabicUtil
     /**
      * Process Arabic string (UTF-8 convenience wrapper)
      * @param str Input UTF-8 string
+     * @param pool Cache pool the text belongs to
      * @return Processed UTF-8 string
      */
-    std::string processArabicString(const std::string& str);
+    std::string processArabicString(const std::string& str,
+                                    LLArabicSupport::ECachePool pool = LLArabicSupport::CACHE_POOL_UI);
 }
 
 #endif // LL_LLARABICSUPPORT_H
@@ -0,0 +1,458 @@
+/**
+ * @file test_arabic_memory.cpp
+ * @brief Allocation and memory regression test for Arabic text support
+ * @author Sela Viewer Team
+ *
+ * Replaces the global operator new/delete to count heap allocations and
+ * peak heap bytes, runs every public text API over a fixed corpus and
+ * fails (exit code 1) when an API goes over its budget. Also reports how
+ * much memory the text cache takes per 1,000 entries.
+ *
+ * Budgets are the numbers measured with a font given, so with shaping
+ * on, on 64-bit Linux with libstdc++ (4-byte wchar_t); they were recorded
+ * with Lato Regular. An API may go BUDGET_MARGIN_PERCENT over its budget
+ * before it fails, which covers other fonts and runs without a font (the
+ * cache then holds no shaped runs and its fill allocates a little less).
+ * Budgets of 0 allow no allocation at all. HarfBuzz and FriBidi allocate
+ * with malloc and are not counted. When a change needs more memory on
+ * purpose, record the new numbers here in the same commit.
+ *
+ * Usage: test_arabic_memory [font.ttf]
+ * Built by Arabic.cmake with ARABIC_MEMORY_TEST=ON.
+ */
+
+#include "llarabicsupport.h"
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+// ANSI color codes for better output
+#define RESET   "\033[0m"
+#define RED     "\033[31m"
+#define GREEN   "\033[32m"
+#define YELLOW  "\033[33m"
+#define BLUE    "\033[34m"
+#define MAGENTA "\033[35m"
+#define CYAN    "\033[36m"
+
+//-----------------------------------------------------------------------------
+// Counting allocator
+//-----------------------------------------------------------------------------
+
+namespace
+{
+    std::atomic<size_t> sAllocations(0);
+    std::atomic<size_t> sLiveBytes(0);
+    std::atomic<size_t> sPeakBytes(0);
+    
+    // Stored in front of every block, so delete knows its size
+    struct BlockHeader
+    {
+        void* mBase;
+        size_t mSize;
+    };
+    
+    void* countedAlloc(size_t size, size_t align) noexcept
+    {
+        align = std::max(align, alignof(std::max_align_t));
+        char* base = static_cast<char*>(std::malloc(size + sizeof(BlockHeader) + align));
+        if (!base)
+        {
+            return nullptr;
+        }
+        
+        uintptr_t block = (reinterpret_cast<uintptr_t>(base) + sizeof(BlockHeader) + align - 1) &
+                          ~(static_cast<uintptr_t>(align) - 1);
+        BlockHeader* header = reinterpret_cast<BlockHeader*>(block) - 1;
+        header->mBase = base;
+        header->mSize = size;
+        
+        sAllocations.fetch_add(1, std::memory_order_relaxed);
+        size_t live = sLiveBytes.fetch_add(size, std::memory_order_relaxed) + size;
+        size_t peak = sPeakBytes.load(std::memory_order_relaxed);
+        while (live > peak &&
+               !sPeakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+        {
+        }
+        return reinterpret_cast<void*>(block);
+    }
+    
+    void* countedNew(size_t size, size_t align)
+    {
+        void* ptr = countedAlloc(size, align);
+        if (!ptr)
+        {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+    
+    void countedFree(void* ptr) noexcept
+    {
+        if (ptr)
+        {
+            BlockHeader* header = static_cast<BlockHeader*>(ptr) - 1;
+            sLiveBytes.fetch_sub(header->mSize, std::memory_order_relaxed);
+            std::free(header->mBase);
+        }
+    }
+}
+
+void* operator new(size_t size) { return countedNew(size, 0); }
+void* operator new[](size_t size) { return countedNew(size, 0); }
+void* operator new(size_t size, std::align_val_t align) { return countedNew(size, static_cast<size_t>(align)); }
+void* operator new[](size_t size, std::align_val_t align) { return countedNew(size, static_cast<size_t>(align)); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return countedAlloc(size, 0); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return countedAlloc(size, 0); }
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept { return countedAlloc(size, static_cast<size_t>(align)); }
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept { return countedAlloc(size, static_cast<size_t>(align)); }
+
+void operator delete(void* ptr) noexcept { countedFree(ptr); }
+void operator delete[](void* ptr) noexcept { countedFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { countedFree(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { countedFree(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { countedFree(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { countedFree(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { countedFree(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { countedFree(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { countedFree(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { countedFree(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { countedFree(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { countedFree(ptr); }
+
+//-----------------------------------------------------------------------------
+// Measurements and budgets
+//-----------------------------------------------------------------------------
+
+namespace
+{
+    struct Measurement
+    {
+        size_t mAllocations;
+        size_t mPeakBytes;          // Above what was live before
+    };
+    
+    Measurement measure(const std::function<void()>& work)
+    {
+        size_t allocations = sAllocations.load();
+        size_t live = sLiveBytes.load();
+        sPeakBytes.store(live);
+        work();
+        return Measurement{ sAllocations.load() - allocations, sPeakBytes.load() - live };
+    }
+    
+    // Fixed corpus: nameplates, UI labels, chat, mixed text and digits
+    const wchar_t* const CORPUS[] =
+    {
+        L"مرحبا",
+        L"اسم المستخدم",
+        L"السلام عليكم ورحمة الله وبركاته",
+        L"Hello مرحبا World",
+        L"رقم الغرفة 42 في الطابق ٣",
+        L"Teleport to منطقة الصحراء (128, 64, 22)",
+        L"كيف حالك اليوم يا صديقي؟ أتمنى أن تكون بخير",
+        L"plain English text without Arabic",
+    };
+    const size_t CORPUS_SIZE = sizeof(CORPUS) / sizeof(CORPUS[0]);
+    
+    const wchar_t* const VOCABULARY[] =
+    {
+        L"مرحبا", L"كيف", L"حالك", L"اليوم", L"يا", L"صديقي",
+        L"أهلا", L"وسهلا", L"شكرا", L"جزيلا", L"إلى", L"اللقاء",
+    };
+    const size_t VOCABULARY_SIZE = sizeof(VOCABULARY) / sizeof(VOCABULARY[0]);
+    
+    // A notecard: paragraphs of the corpus, long enough to be processed
+    // in parallel
+    std::wstring makeNotecard()
+    {
+        std::wstring notecard;
+        while (notecard.size() < 8192)
+        {
+            for (size_t i = 0; i < CORPUS_SIZE; ++i)
+            {
+                notecard += CORPUS[i];
+                notecard += L'\n';
+            }
+        }
+        return notecard;
+    }
+    
+    // Every API runs twice over the corpus before it is measured, so lazy
+    // set-up (font, cache, thread-local buffers, worker threads) and the
+    // first cache inserts are not counted
+    const int WARM_UP_PASSES = 2;
+    const int MEASURED_PASSES = 10;
+    
+    // Headroom over the recorded budgets, rounded up
+    const size_t BUDGET_MARGIN_PERCENT = 5;
+    
+    int sFailures = 0;
+    
+    // The corpus as the APIs take it, built before anything is measured
+    std::vector<std::wstring> sWide;
+    std::vector<std::string> sUtf8;
+    std::wstring sParagraphs;       // A short multi-paragraph message
+    
+    void printHeader(const std::string& title)
+    {
+        std::cout << "\n" << CYAN << "═══════════════════════════════════════════════════════════════════" << RESET << "\n";
+        std::cout << YELLOW << "  " << title << RESET << "\n";
+        std::cout << CYAN << "═══════════════════════════════════════════════════════════════════" << RESET << "\n";
+        std::cout << "  " << std::left << std::setw(36) << "API"
+                  << std::right << std::setw(14) << "allocations"
+                  << std::setw(14) << "peak bytes" << "\n";
+    }
+    
+    size_t withMargin(size_t budget)
+    {
+        return budget + (budget * BUDGET_MARGIN_PERCENT + 99) / 100;
+    }
+    
+    void checkBudget(const std::string& name, const Measurement& measured,
+                     size_t budget_allocations, size_t budget_peak_bytes)
+    {
+        size_t max_allocations = withMargin(budget_allocations);
+        size_t max_peak_bytes = withMargin(budget_peak_bytes);
+        bool ok = measured.mAllocations <= max_allocations &&
+                  measured.mPeakBytes <= max_peak_bytes;
+        std::cout << (ok ? GREEN "✓ " : RED "✗ ") << std::left << std::setw(36) << name
+                  << std::right << std::setw(6) << measured.mAllocations
+                  << " / " << std::setw(5) << max_allocations
+                  << std::setw(7) << measured.mPeakBytes
+                  << " / " << std::setw(5) << max_peak_bytes << RESET << "\n";
+        if (!ok)
+        {
+            ++sFailures;
+        }
+    }
+    
+    // Runs work until warm, then measures MEASURED_PASSES of it
+    Measurement measurePasses(const std::function<void()>& pass)
+    {
+        for (int i = 0; i < WARM_UP_PASSES; ++i)
+        {
+            pass();
+        }
+        return measure([&]()
+        {
+            for (int i = 0; i < MEASURED_PASSES; ++i)
+            {
+                pass();
+            }
+        });
+    }
+    
+    // The same, with work run over the whole corpus in every pass
+    Measurement measureCorpus(const std::function<void(size_t)>& work)
+    {
+        return measurePasses([&]()
+        {
+            for (size_t i = 0; i < CORPUS_SIZE; ++i)
+            {
+                work(i);
+            }
+        });
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Scenarios
+//-----------------------------------------------------------------------------
+
+// Cached text: the render loop redraws the same strings every frame
+void measureCacheHits()
+{
+    printHeader("Cache hits (" + std::to_string(MEASURED_PASSES) + " passes over " +
+                std::to_string(CORPUS_SIZE) + " strings)");
+    
+    LLArabicSupport& arabic = LLArabicSupport::instance();
+    arabic.setEnableCache(true);
+    wchar_t buffer[256];
+    
+    checkBudget("processArabicText(wstring)", measureCorpus([&](size_t i)
+    {
+        arabic.processArabicText(sWide[i]);
+    }), 80, 176);
+    
+    checkBudget("processArabicText(buffer)", measureCorpus([&](size_t i)
+    {
+        arabic.processArabicText(std::wstring_view(sWide[i]), buffer, 256);
+    }), 0, 0);
+    
+    checkBudget("processArabicText(buffer, paragraphs)", measurePasses([&]()
+    {
+        arabic.processArabicText(std::wstring_view(sParagraphs), buffer, 256);
+    }), 0, 0);
+    
+    checkBudget("findProcessedText", measureCorpus([&](size_t i)
+    {
+        LLArabicSupport::CachedText text;
+        arabic.findProcessedText(sWide[i], text);
+    }), 0, 0);
+    
+    checkBudget("reorderBidiText", measureCorpus([&](size_t i)
+    {
+        arabic.reorderBidiText(sWide[i]);
+    }), 80, 176);
+    
+    checkBudget("processArabicString (UTF-8)", measureCorpus([&](size_t i)
+    {
+        LLArabicUtil::processArabicString(sUtf8[i]);
+    }), 400, 1996);
+    
+    std::wstring notecard = makeNotecard();
+    checkBudget("processArabicDocument (8K notecard)", measurePasses([&]()
+    {
+        arabic.processArabicDocument(notecard);
+    }), 3262, 114672);
+}
+
+// Text that is not cached: processed from scratch every time
+void measureUncached()
+{
+    printHeader("Uncached (" + std::to_string(MEASURED_PASSES) + " passes over " +
+                std::to_string(CORPUS_SIZE) + " strings)");
+    
+    LLArabicSupport& arabic = LLArabicSupport::instance();
+    arabic.setEnableCache(false);
+    wchar_t buffer[256];
+    
+    checkBudget("processArabicText(wstring)", measureCorpus([&](size_t i)
+    {
+        arabic.processArabicText(sWide[i]);
+    }), 80, 176);
+    
+    checkBudget("processArabicText(buffer)", measureCorpus([&](size_t i)
+    {
+        arabic.processArabicText(std::wstring_view(sWide[i]), buffer, 256);
+    }), 0, 0);
+    
+    checkBudget("processArabicText(buffer, paragraphs)", measurePasses([&]()
+    {
+        arabic.processArabicText(std::wstring_view(sParagraphs), buffer, 256);
+    }), 0, 0);
+    
+    checkBudget("reorderBidiText", measureCorpus([&](size_t i)
+    {
+        arabic.reorderBidiText(sWide[i]);
+    }), 80, 176);
+    
+    checkBudget("processArabicString (UTF-8)", measureCorpus([&](size_t i)
+    {
+        LLArabicUtil::processArabicString(sUtf8[i]);
+    }), 400, 1996);
+    
+    checkBudget("utf8_to_wstring", measureCorpus([&](size_t i)
+    {
+        LLArabicUtil::utf8_to_wstring(sUtf8[i]);
+    }), 160, 1604);
+    
+    checkBudget("wstring_to_utf8", measureCorpus([&](size_t i)
+    {
+        LLArabicUtil::wstring_to_utf8(sWide[i]);
+    }), 160, 256);
+    
+    arabic.setEnableCache(true);
+}
+
+// Heap taken by the cache for 1,000 unique chat lines, and what filling it
+// costs
+void measureCacheMemory()
+{
+    printHeader("Cache memory (1,000 unique chat lines)");
+    
+    LLArabicSupport& arabic = LLArabicSupport::instance();
+    arabic.setEnableCache(true);
+    arabic.clearCache();
+    arabic.handleMemoryPressure();  // Frees what the clear retired
+    
+    std::vector<std::wstring> lines;
+    for (size_t i = 0; lines.size() < 1000; ++i)
+    {
+        lines.push_back(std::wstring(VOCABULARY[i % VOCABULARY_SIZE]) + L" " +
+                        VOCABULARY[(i / VOCABULARY_SIZE) % VOCABULARY_SIZE] + L" " +
+                        VOCABULARY[(i / VOCABULARY_SIZE / VOCABULARY_SIZE) % VOCABULARY_SIZE]);
+    }
+    
+    wchar_t buffer[256];
+    size_t live = sLiveBytes.load();
+    Measurement fill = measure([&]()
+    {
+        for (const std::wstring& line : lines)
+        {
+            arabic.processArabicText(std::wstring_view(line), buffer, 256,
+                                     LLArabicSupport::CACHE_POOL_CHAT);
+        }
+    });
+    size_t held = sLiveBytes.load() - live;
+    
+    LLArabicSupport::CacheStats stats;
+    arabic.getCacheStats(stats);
+    size_t entries = stats.mEntries[LLArabicSupport::CACHE_POOL_CHAT];
+    size_t entry_bytes = stats.mBytes[LLArabicSupport::CACHE_POOL_CHAT];
+    size_t per_thousand = entries ? held * 1000 / entries : 0;
+    
+    checkBudget("fill", fill, 177, 390384);
+    std::cout << BLUE << "  " << entries << " entries (lines and shaped runs), "
+              << entry_bytes << " bytes of records, " << stats.mSlabBytes << " in slabs\n";
+    std::cout << "  Heap per 1,000 entries: " << per_thousand << " bytes ("
+              << (entries ? entry_bytes * 1000 / entries : 0) << " in records)" << RESET << "\n";
+    checkBudget("heap per 1,000 entries", Measurement{ 0, per_thousand }, 0, 385754);
+    
+    arabic.clearCache();
+}
+
+// Main test runner
+int main(int argc, char* argv[])
+{
+    std::cout << "\n";
+    std::cout << MAGENTA << "╔═══════════════════════════════════════════════════╗\n";
+    std::cout << "║                                                   ║\n";
+    std::cout << "║    Sela Viewer - Arabic Support Memory Budgets    ║\n";
+    std::cout << "║                                                   ║\n";
+    std::cout << "╚═══════════════════════════════════════════════════╝" << RESET << "\n";
+    
+    LLArabicSupport& arabic = LLArabicSupport::instance();
+    if (argc > 1)
+    {
+        arabic.initialize(std::string(argv[1]));
+    }
+    else
+    {
+        std::cout << BLUE << "  No font given (usage: test_arabic_memory <font.ttf>), "
+                  << "measuring without shaping" << RESET << "\n";
+    }
+    
+    for (size_t i = 0; i < CORPUS_SIZE; ++i)
+    {
+        sWide.push_back(CORPUS[i]);
+        sUtf8.push_back(LLArabicUtil::wstring_to_utf8(sWide[i]));
+    }
+    sParagraphs = std::wstring(CORPUS[0]) + L"\n" + CORPUS[2] + L"\r\n" + CORPUS[4];
+    
+    measureCacheMemory();
+    measureCacheHits();
+    measureUncached();
+    
+    std::cout << "\n" << CYAN << "═══════════════════════════════════════" << RESET << "\n";
+    if (sFailures > 0)
+    {
+        std::cout << RED << "  " << sFailures << " over budget" << RESET << "\n";
+    }
+    else
+    {
+        std::cout << GREEN << "  All within budget" << RESET << "\n";
+    }
+    std::cout << CYAN << "═══════════════════════════════════════" << RESET << "\n\n";
+    
+    return sFailures > 0 ? 1 : 0;
+}
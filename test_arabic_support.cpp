@@ -8,6 +8,24 @@
 #include <iostream>
 #include <iomanip>
 #include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <thread>
+#include <vector>
+#include <fribidi/fribidi.h>
+#include <harfbuzz/hb.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // ANSI color codes for better output
 #define RESET   "\033[0m"
@@ -359,6 +377,1097 @@ void testCachingSystem()
     }
 }
 
+// Test 7: Cache Admission Under Chat Floods
+void testCacheAdmission()
+{
+    printTestHeader("Cache Admission Under Chat Floods");
+    
+    LLArabicSupport& arabic = LLArabicSupport::instance();
+    arabic.clearCache();
+    arabic.setPoolCacheSize(LLArabicSupport::CACHE_POOL_UI, 24 * 1024);
+    arabic.setPoolCacheSize(LLArabicSupport::CACHE_POOL_CHAT, 12 * 1024);
+    
+    // Stable UI labels, each shown a few times
+    std::vector<std::wstring> labels;
+    for (int i = 0; i < 50; ++i)
+    {
+        labels.push_back(L"قائمة " + std::to_wstring(i));
+    }
+    for (int round = 0; round < 3; ++round)
+    {
+        for (const auto& label : labels)
+        {
+            arabic.processArabicText(label, LLArabicSupport::CACHE_POOL_UI);
+        }
+    }
+    
+    // A chat flood of one-off lines, interleaved with a few hot lines
+    std::vector<std::wstring> hot_lines;
+    for (int i = 0; i < 20; ++i)
+    {
+        hot_lines.push_back(L"مرحبا يا صديقي " + std::to_wstring(i));
+    }
+    for (int i = 0; i < 5000; ++i)
+    {
+        arabic.processArabicText(L"رسالة عابرة " + std::to_wstring(i),
+                                 LLArabicSupport::CACHE_POOL_CHAT);
+        arabic.processArabicText(hot_lines[i % hot_lines.size()],
+                                 LLArabicSupport::CACHE_POOL_CHAT);
+    }
+    
+    LLArabicSupport::CacheStats before;
+    arabic.getCacheStats(before);
+    
+    for (const auto& label : labels)
+    {
+        arabic.processArabicText(label, LLArabicSupport::CACHE_POOL_UI);
+    }
+    for (const auto& line : hot_lines)
+    {
+        arabic.processArabicText(line, LLArabicSupport::CACHE_POOL_CHAT);
+    }
+    
+    LLArabicSupport::CacheStats after;
+    arabic.getCacheStats(after);
+    
+    size_t ui_hits = after.mHits[LLArabicSupport::CACHE_POOL_UI] -
+                     before.mHits[LLArabicSupport::CACHE_POOL_UI];
+    size_t chat_hits = after.mHits[LLArabicSupport::CACHE_POOL_CHAT] -
+                       before.mHits[LLArabicSupport::CACHE_POOL_CHAT];
+    
+    std::cout << "  Chat pool: " << after.mEntries[LLArabicSupport::CACHE_POOL_CHAT]
+              << " entries, " << after.mRejected[LLArabicSupport::CACHE_POOL_CHAT]
+              << " rejected, " << after.mEvictions[LLArabicSupport::CACHE_POOL_CHAT]
+              << " evicted\n";
+    
+    if (ui_hits == labels.size())
+    {
+        printSuccess("UI labels survived the chat flood");
+    }
+    else
+    {
+        printFailure("UI labels were evicted by the chat flood");
+    }
+    
+    if (chat_hits == hot_lines.size())
+    {
+        printSuccess("Hot chat lines survived the one-off flood");
+    }
+    else
+    {
+        printFailure("Hot chat lines were evicted by one-off lines");
+    }
+    
+    arabic.setMaxCacheSize(LLArabicSupport::DEFAULT_CACHE_SIZE);
+    arabic.clearCache();
+}
+
+// Test 8: Concurrent Read Scaling
+void testConcurrentReadScaling()
+{
+    printTestHeader("Concurrent Read Scaling");
+    
+    LLArabicSupport& arabic = LLArabicSupport::instance();
+    arabic.clearCache();
+    
+    // Hot set that fits the cache comfortably
+    std::vector<std::wstring> hot_set;
+    for (int i = 0; i < 256; ++i)
+    {
+        hot_set.push_back(L"اسم المستخدم " + std::to_wstring(i));
+    }
+    for (int round = 0; round < 2; ++round)
+    {
+        for (const auto& text : hot_set)
+        {
+            arabic.processArabicText(text);
+        }
+    }
+    
+    const size_t lookups_per_thread = 200000;
+    const unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+    printInfo("Hardware threads: " + std::to_string(cores) +
+              ", one writer thread inserting chat lines throughout");
+    
+    double base_rate = 0.0;
+    bool scaling_ok = true;
+    for (unsigned int threads = 1; threads <= 16; threads *= 2)
+    {
+        std::atomic<bool> stop_writer(false);
+        std::thread writer([&arabic, &stop_writer]()
+        {
+            for (int i = 0; !stop_writer.load(); ++i)
+            {
+                arabic.processArabicText(L"رسالة " + std::to_wstring(i),
+                                         LLArabicSupport::CACHE_POOL_CHAT);
+            }
+        });
+        
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> readers;
+        for (unsigned int t = 0; t < threads; ++t)
+        {
+            readers.emplace_back([&arabic, &hot_set, t, lookups_per_thread]()
+            {
+                size_t index = t * 37;
+                for (size_t i = 0; i < lookups_per_thread; ++i)
+                {
+                    arabic.processArabicText(hot_set[index++ % hot_set.size()]);
+                }
+            });
+        }
+        for (auto& reader : readers)
+        {
+            reader.join();
+        }
+        double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        
+        stop_writer = true;
+        writer.join();
+        
+        double rate = threads * lookups_per_thread / seconds;
+        if (threads == 1)
+        {
+            base_rate = rate;
+        }
+        double speedup = rate / base_rate;
+        std::cout << "  " << std::setw(2) << threads << " threads: "
+                  << std::fixed << std::setprecision(2) << rate / 1e6
+                  << " M lookups/s, speedup " << speedup << "x\n";
+        
+        // Only judge scaling where there are cores to scale onto
+        if (threads <= cores && speedup < 0.7 * threads)
+        {
+            scaling_ok = false;
+        }
+    }
+    
+    if (scaling_ok)
+    {
+        printSuccess("Read throughput scales with available cores");
+    }
+    else
+    {
+        printFailure("Read throughput does not scale with available cores");
+    }
+    
+    arabic.clearCache();
+}
+
+// Test 9: Caller-Provided Buffers
+void testCallerBuffers()
+{
+    printTestHeader("Caller-Provided Buffers");
+    
+    LLArabicSupport& arabic = LLArabicSupport::instance();
+    arabic.clearCache();
+    
+    std::wstring text = L"السلام عليكم يا أصدقاء";
+    std::wstring expected = arabic.processArabicText(text, LLArabicSupport::CACHE_POOL_CHAT);
+    
+    // Too small: nothing written, required length returned
+    wchar_t tiny[4] = { L'x', L'x', L'x', L'x' };
+    size_t required = arabic.processArabicText(text, tiny, 4, LLArabicSupport::CACHE_POOL_CHAT);
+    if (required == expected.size() && tiny[0] == L'x')
+    {
+        printSuccess("Short buffer reports the required length");
+    }
+    else
+    {
+        printFailure("Short buffer handling is wrong");
+    }
+    
+    wchar_t buffer[64];
+    size_t length = arabic.processArabicText(text, buffer, 64, LLArabicSupport::CACHE_POOL_CHAT);
+    if (std::wstring(buffer, length) == expected)
+    {
+        printSuccess("Buffer output matches processArabicText");
+    }
+    else
+    {
+        printFailure("Buffer output differs from processArabicText");
+    }
+    
+    // Paragraphs are written into the buffer one after the other
+    std::wstring document = L"سطر أول\nسطر ثان\r\n\nسطر ثالث\n";
+    std::wstring expected_document = arabic.processArabicText(document, LLArabicSupport::CACHE_POOL_CHAT);
+    length = arabic.processArabicText(document, buffer, 64, LLArabicSupport::CACHE_POOL_CHAT);
+    if (std::wstring(buffer, length) == expected_document &&
+        arabic.processArabicText(document, tiny, 4, LLArabicSupport::CACHE_POOL_CHAT) == length)
+    {
+        printSuccess("Paragraphs are written straight into the buffer");
+    }
+    else
+    {
+        printFailure("Buffer output of paragraphs differs from processArabicText");
+    }
+    
+    LLArabicSupport::CachedText cached;
+    if (arabic.findProcessedText(text, cached, LLArabicSupport::CACHE_POOL_CHAT) &&
+        cached.text() == expected)
+    {
+        printSuccess("Cached text returned without copying");
+    }
+    else
+    {
+        printFailure("Cached text lookup failed");
+    }
+    cached.release();
+    
+    std::wstring english = L"Hello World";
+    if (arabic.findProcessedText(english, cached) &&
+        cached.text().data() == english.data())
+    {
+        printSuccess("Non-Arabic text is passed through as-is");
+    }
+    else
+    {
+        printFailure("Non-Arabic text was not passed through");
+    }
+    
+    if (!arabic.findProcessedText(L"نص لم يعالج بعد", cached))
+    {
+        printSuccess("Uncached text reports a miss");
+    }
+    else
+    {
+        printFailure("Uncached text reported a hit");
+    }
+    
+    arabic.clearCache();
+}
+
+// Test 10: Pipeline Tracing
+void testPipelineTracing()
+{
+    printTestHeader("Pipeline Tracing");
+    
+    const std::string trace_file = "arabic_trace_test.json";
+    if (!LLArabicSupport::startTrace(trace_file))
+    {
+        printInfo("Tracing not built in (define LL_ARABIC_TRACING to enable)");
+        return;
+    }
+    
+    LLArabicSupport& arabic = LLArabicSupport::instance();
+    arabic.processArabicText(L"مرحبا بك في العالم");
+    arabic.processArabicText(L"مرحبا بك في العالم");
+    LLArabicUtil::processArabicString("Hello مرحبا");
+    LLArabicSupport::stopTrace();
+    
+    std::ifstream in(trace_file);
+    std::string contents((std::istreambuf_iterator<char>(in)),
+                         std::istreambuf_iterator<char>());
+    
+    // The repeated line is served by this thread's L1, or by the process
+    // cache if the L1 entry has been invalidated since
+    bool hit = contents.find("\"cache\":\"local hit\"") != std::string::npos ||
+               contents.find("\"cache\":\"hit\"") != std::string::npos;
+    if (contents.find("\"traceEvents\"") != std::string::npos &&
+        contents.find("\"processArabicText\"") != std::string::npos && hit)
+    {
+        printSuccess("Trace file contains pipeline zones and cache outcomes");
+    }
+    else
+    {
+        printFailure("Trace file is missing pipeline zones");
+    }
+    
+    std::remove(trace_file.c_str());
+}
+
+// Test 11: Multi-Paragraph Documents
+void testDocumentProcessing()
+{
+    printTestHeader("Multi-Paragraph Documents");
+    
+    LLArabicSupport& arabic = LLArabicSupport::instance();
+    arabic.clearCache();
+    
+    std::wstring first = L"الفقرة الأولى من البطاقة";
+    std::wstring second = L"Second paragraph مع نص عربي";
+    std::wstring third = L"الفقرة الثالثة 123";
+    std::wstring document = first + L"\n" + second + L"\r\n" + third;
+    
+    std::wstring expected = arabic.processArabicText(first) + L"\n" +
+                            arabic.processArabicText(second) + L"\r\n" +
+                            arabic.processArabicText(third);
+    if (arabic.processArabicDocument(document) == expected)
+    {
+        printSuccess("Paragraphs are processed independently");
+    }
+    else
+    {
+        printFailure("Document output differs from per-paragraph output");
+    }
+    
+    // Editing one paragraph only reprocesses that paragraph
+    size_t cache_size, hits_before, misses_before, hits_after, misses_after;
+    arabic.getCacheStats(cache_size, hits_before, misses_before);
+    arabic.processArabicDocument(first + L"\n" + second + L"\r\n" + L"فقرة معدلة");
+    arabic.getCacheStats(cache_size, hits_after, misses_after);
+    
+    // The two unchanged paragraphs hit, the edited one misses
+    if (hits_after - hits_before == 2 && misses_after - misses_before == 1)
+    {
+        printSuccess("Only the edited paragraph was reprocessed");
+    }
+    else
+    {
+        printFailure("Unchanged paragraphs were reprocessed");
+    }
+    
+    // Large documents take the parallel path
+    std::wstring notecard;
+    std::wstring serial;
+    for (int i = 0; i < 300; ++i)
+    {
+        std::wstring paragraph = L"سطر رقم " + std::to_wstring(i) + L" من بطاقة طويلة";
+        notecard += paragraph + L"\n";
+        serial += arabic.processArabicText(paragraph) + L"\n";
+    }
+    arabic.clearCache();
+    if (arabic.processArabicDocument(notecard) == serial)
+    {
+        printSuccess("Parallel processing matches serial processing");
+    }
+    else
+    {
+        printFailure("Parallel processing differs from serial processing");
+    }
+    
+    arabic.clearCache();
+}
+
+// Test 12: Lazy Font Loading
+void testLazyFontLoading(const std::string& font_path)
+{
+    printTestHeader("Lazy Font Loading");
+    
+    LLArabicSupport& arabic = LLArabicSupport::instance();
+    if (!arabic.isInitialized() && !arabic.initialize("/nonexistent/arabic-font.ttf") &&
+        !arabic.isInitialized())
+    {
+        printSuccess("Missing font file is rejected by initialize()");
+    }
+    else if (!arabic.isInitialized())
+    {
+        printFailure("initialize() accepted a missing font file");
+    }
+    
+    if (font_path.empty())
+    {
+        printInfo("No font given (usage: test_arabic_support <font.ttf>), skipping");
+        return;
+    }
+    
+    if (!arabic.initialize(font_path))
+    {
+        printFailure("initialize() rejected the font path");
+        return;
+    }
+    
+    arabic.processArabicText(L"Hello World");
+    LLArabicTextLayout layout(L"Hello World\nA second paragraph", 16.f);
+    if (!arabic.isFontLoaded())
+    {
+        printSuccess("Font not loaded for non-Arabic text or its layout");
+    }
+    else
+    {
+        printFailure("Font loaded before any Arabic text");
+    }
+    
+    arabic.processArabicText(L"مرحبا بالعالم");
+    if (arabic.isFontLoaded())
+    {
+        printSuccess("Font loaded with the first Arabic text");
+    }
+    else
+    {
+        printFailure("Font was not loaded for Arabic text");
+    }
+}
+
+// Test 13: Line Wrapping
+void testTextLayout()
+{
+    printTestHeader("Line Wrapping");
+    
+    std::wstring text = L"مرحبا بالعالم hello world 123 نص";
+    LLArabicTextLayout layout(text, 16.f);
+    std::vector<LLArabicTextLayout::Line> lines;
+    
+    layout.wrap(layout.getNaturalWidth(), lines);
+    if (lines.size() == 1 && lines[0].mLength == text.size())
+    {
+        printSuccess("Text fits on one line at its natural width");
+    }
+    else
+    {
+        printFailure("Text wrapped at its natural width");
+    }
+    
+    // Every width must cover the text with consecutive lines that fit
+    bool covered = true;
+    bool fits = true;
+    size_t narrow_lines = 0;
+    for (float width = layout.getNaturalWidth(); width >= 0.f; width -= 7.f)
+    {
+        layout.wrap(width, lines);
+        size_t next = 0;
+        for (const LLArabicTextLayout::Line& line : lines)
+        {
+            covered = covered && line.mStart == next;
+            next = line.mStart + line.mLength;
+            
+            // Only a single word may overflow
+            std::wstring_view chars = std::wstring_view(text).substr(line.mStart, line.mLength);
+            bool single_word = chars.find(L' ') == std::wstring_view::npos ||
+                               chars.find(L' ') == chars.find_last_not_of(L' ') + 1;
+            fits = fits && (line.mWidth <= width || single_word);
+        }
+        covered = covered && next == text.size();
+        narrow_lines = lines.size();
+    }
+    if (covered && fits)
+    {
+        printSuccess("Lines cover the text and fit the width");
+    }
+    else
+    {
+        printFailure("Lines skip text or overflow the width");
+    }
+    
+    if (narrow_lines == 6)
+    {
+        printSuccess("Zero width gives one word per line");
+    }
+    else
+    {
+        printFailure("Zero width gave " + std::to_string(narrow_lines) + " lines");
+    }
+    
+    // A wrapped RTL paragraph starts with its first logical word
+    layout.wrap(0.f, lines);
+    if (lines.size() == 6 && lines[0].mStart == 0 && !lines[0].mText.empty() &&
+        lines[3].mStart == text.find(L"world"))
+    {
+        printSuccess("Lines keep the paragraph order");
+    }
+    else
+    {
+        printFailure("Lines are out of order");
+    }
+    
+    // Paragraph separators always break
+    LLArabicTextLayout paragraphs(L"سطر أول\nsecond\n\nرابع", 16.f);
+    paragraphs.wrap(1000.f, lines);
+    if (lines.size() == 4 && lines[2].mLength == 0 && lines[3].mStart == 16)
+    {
+        printSuccess("Paragraph separators start new lines");
+    }
+    else
+    {
+        printFailure("Paragraph separators were not honoured");
+    }
+}
+
+// Test 14: Cache Memory
+void testCacheMemory()
+{
+    printTestHeader("Cache Memory");
+    
+    LLArabicSupport& arabic = LLArabicSupport::instance();
+    arabic.clearCache();
+    arabic.setMaxCacheSize(64 * 1024);
+    
+    for (int i = 0; i < 5000; ++i)
+    {
+        arabic.processArabicText(L"رسالة في الدردشة رقم " + std::to_wstring(i),
+                                 LLArabicSupport::CACHE_POOL_CHAT);
+    }
+    
+    LLArabicSupport::CacheStats full;
+    arabic.getCacheStats(full);
+    size_t chat_bytes = full.mBytes[LLArabicSupport::CACHE_POOL_CHAT];
+    std::cout << "  " << full.mEntries[LLArabicSupport::CACHE_POOL_CHAT] << " entries in "
+              << chat_bytes << " bytes, " << full.mSlabBytes << " bytes of slabs\n";
+    
+    if (chat_bytes > 0 && chat_bytes <= full.mCapacity[LLArabicSupport::CACHE_POOL_CHAT])
+    {
+        printSuccess("Pool stays within its byte budget");
+    }
+    else
+    {
+        printFailure("Pool exceeds its byte budget");
+    }
+    
+    // Holes left by evictions are reclaimed, so slabs stay close to the budget
+    if (full.mSlabBytes <= 3 * 64 * 1024)
+    {
+        printSuccess("Slab memory stays bounded");
+    }
+    else
+    {
+        printFailure("Slab memory keeps growing");
+    }
+    
+    arabic.handleMemoryPressure();
+    LLArabicSupport::CacheStats trimmed;
+    arabic.getCacheStats(trimmed);
+    if (trimmed.mBytes[LLArabicSupport::CACHE_POOL_CHAT] <= chat_bytes / 2 &&
+        trimmed.mSlabBytes < full.mSlabBytes)
+    {
+        printSuccess("Memory pressure shrinks the cache");
+    }
+    else
+    {
+        printFailure("Memory pressure did not shrink the cache");
+    }
+    
+    // Keys outside the BMP are stored as surrogate pairs and still match
+    std::wstring emoji = L"مرحبا ";
+    emoji += static_cast<wchar_t>(sizeof(wchar_t) > 2 ? 0x1F600 : 0xD83D);
+    if (sizeof(wchar_t) == 2)
+    {
+        emoji += static_cast<wchar_t>(0xDE00);
+    }
+    size_t cache_size, hits_before, misses, hits_after;
+    std::wstring first = arabic.processArabicText(emoji);
+    arabic.getCacheStats(cache_size, hits_before, misses);
+    std::wstring second = arabic.processArabicText(emoji);
+    arabic.getCacheStats(cache_size, hits_after, misses);
+    if (hits_after == hits_before + 1 && first == second)
+    {
+        printSuccess("Keys outside the BMP are found again");
+    }
+    else
+    {
+        printFailure("Keys outside the BMP are not found");
+    }
+    
+    arabic.setMaxCacheSize(LLArabicSupport::DEFAULT_CACHE_SIZE);
+    arabic.clearCache();
+}
+
+// Test 15: Thread-Local Cache
+void testLocalCache()
+{
+    printTestHeader("Thread-Local Cache");
+    
+    LLArabicSupport& arabic = LLArabicSupport::instance();
+    arabic.clearCache();
+    
+    std::wstring nameplate = L"اسم المستخدم";
+    for (int i = 0; i < 10; ++i)
+    {
+        arabic.processArabicText(nameplate);
+    }
+    
+    LLArabicSupport::CacheStats stats;
+    arabic.getCacheStats(stats);
+    size_t local_hits = stats.mLocalHits[LLArabicSupport::CACHE_POOL_UI];
+    size_t hits = stats.mHits[LLArabicSupport::CACHE_POOL_UI];
+    std::cout << "  L1: " << local_hits << " of " << hits << " hits\n";
+    if (local_hits == 9 && hits == 9)
+    {
+        printSuccess("Repeated lookups are served by the thread-local cache");
+    }
+    else
+    {
+        printFailure("Repeated lookups went to the shared cache");
+    }
+    
+    // Other threads have their own L1 and start at the shared cache
+    std::thread([&]() { arabic.processArabicText(nameplate); }).join();
+    arabic.getCacheStats(stats);
+    if (stats.mLocalHits[LLArabicSupport::CACHE_POOL_UI] == local_hits &&
+        stats.mHits[LLArabicSupport::CACHE_POOL_UI] == hits + 1)
+    {
+        printSuccess("Another thread is served by the shared cache");
+    }
+    else
+    {
+        printFailure("Thread-local entries leaked to another thread");
+    }
+    
+    // Clearing invalidates every thread's copy
+    arabic.clearCache();
+    arabic.processArabicText(nameplate);
+    arabic.getCacheStats(stats);
+    if (stats.mLocalHits[LLArabicSupport::CACHE_POOL_UI] == 0 &&
+        stats.mMisses[LLArabicSupport::CACHE_POOL_UI] == 1)
+    {
+        printSuccess("Clearing the cache invalidates the thread-local cache");
+    }
+    else
+    {
+        printFailure("Stale thread-local entry served after clearing");
+    }
+    
+    arabic.clearCache();
+}
+
+// Test 16: Text Analysis
+void testTextAnalysis()
+{
+    printTestHeader("Text Analysis");
+    
+    LLArabicSupport& arabic = LLArabicSupport::instance();
+    
+    // Presentation forms (pasted text, older clients) are already shaped
+    // but in logical order: they are reordered like any Arabic text, also
+    // next to Latin text and digits, and not shaped again
+    std::wstring logical = L"ﻣﺮﺣﺒﺎ ﺑﻜﻢ";
+    std::wstring mixed = L"ﻣﺮﺣﺒﺎ Sela 2025";
+    std::wstring reversed(logical.rbegin(), logical.rend());
+    if (arabic.processArabicText(logical) == reversed &&
+        arabic.processArabicText(mixed) == arabic.reorderBidiText(mixed) &&
+        arabic.processArabicText(mixed) != mixed)
+    {
+        printSuccess("Presentation forms in logical order are reordered, not reshaped");
+    }
+    else
+    {
+        printFailure("Presentation forms were not reordered");
+    }
+    
+    // Nothing changes form, so nothing is shaped
+    std::wstring digits = L"١٢٣";
+    if (arabic.processArabicText(digits) == digits)
+    {
+        printSuccess("Arabic-Indic digits are left as they are");
+    }
+    else
+    {
+        printFailure("Arabic-Indic digits were changed");
+    }
+    
+    // The analysis replaces the separate scans for Arabic and paragraph
+    // separators, so both kinds of text still take the right path
+    std::wstring document = L"سطر أول\nسطر ثان";
+    std::wstring expected = arabic.processArabicText(L"سطر أول") + L"\n" +
+                            arabic.processArabicText(L"سطر ثان");
+    if (arabic.processArabicText(document) == expected &&
+        arabic.processArabicText(L"plain text") == L"plain text")
+    {
+        printSuccess("Paragraphs and plain text are detected in the same walk");
+    }
+    else
+    {
+        printFailure("Paragraph or plain text detection changed");
+    }
+}
+
+// Test 17: Run-Level Shaping Cache
+void testRunCache()
+{
+    printTestHeader("Run-Level Shaping Cache");
+    
+    LLArabicSupport& arabic = LLArabicSupport::instance();
+    if (!arabic.isFontLoaded())
+    {
+        printInfo("Needs a font (usage: test_arabic_support <font.ttf>), skipping");
+        return;
+    }
+    
+    // Unique chat lines built from a small vocabulary, and words next to a
+    // zero width joiner, which joins them to it
+    const wchar_t* words[] = { L"مرحبا", L"كيف", L"حالك", L"اليوم", L"يا", L"صديقي" };
+    std::vector<std::wstring> lines;
+    for (size_t i = 0; i < 6; ++i)
+    {
+        for (size_t j = 0; j < 6; ++j)
+        {
+            if (i != j)
+            {
+                lines.push_back(std::wstring(words[i]) + L" " + words[j] + L" " + words[(i + j) % 6]);
+            }
+        }
+    }
+    lines.push_back(L"كيف\u200Dحالك كيف");
+    lines.push_back(L"\u200Dيا يا");
+    
+    // Reference: every line shaped whole
+    arabic.setEnableCache(false);
+    std::vector<std::wstring> expected;
+    for (const std::wstring& line : lines)
+    {
+        expected.push_back(arabic.processArabicText(line, LLArabicSupport::CACHE_POOL_CHAT));
+    }
+    arabic.setEnableCache(true);
+    arabic.clearCache();
+    
+    bool same = true;
+    for (size_t i = 0; i < lines.size(); ++i)
+    {
+        same = same && arabic.processArabicText(lines[i], LLArabicSupport::CACHE_POOL_CHAT) == expected[i];
+    }
+    
+    LLArabicSupport::CacheStats stats;
+    arabic.getCacheStats(stats);
+    size_t line_hits = stats.mHits[LLArabicSupport::CACHE_POOL_CHAT];
+    size_t run_hits = stats.mRunHits[LLArabicSupport::CACHE_POOL_CHAT];
+    size_t runs = run_hits + stats.mRunMisses[LLArabicSupport::CACHE_POOL_CHAT];
+    std::cout << "  Lines: " << line_hits << " of " << lines.size() << " hit, runs: "
+              << run_hits << " of " << runs << " hit\n";
+    
+    if (same)
+    {
+        printSuccess("Lines built from cached runs match lines shaped whole");
+    }
+    else
+    {
+        printFailure("Run-level shaping changed the output");
+    }
+    
+    if (line_hits == 0 && runs > 0 && run_hits * 10 >= runs * 8)
+    {
+        printSuccess("Unique lines are mostly built from cached runs");
+    }
+    else
+    {
+        printFailure("Run-level hit rate is too low");
+    }
+    
+    // Whitespace runs are shaped in place and not counted: this line has
+    // three word runs and two space runs
+    arabic.processArabicText(std::wstring(L"يا  صديقي   يا"), LLArabicSupport::CACHE_POOL_CHAT);
+    arabic.getCacheStats(stats);
+    size_t new_runs = stats.mRunHits[LLArabicSupport::CACHE_POOL_CHAT] +
+                      stats.mRunMisses[LLArabicSupport::CACHE_POOL_CHAT] - runs;
+    if (new_runs == 3)
+    {
+        printSuccess("Space runs are left out of the run cache");
+    }
+    else
+    {
+        printFailure("Space runs went through the run cache");
+    }
+    
+    arabic.clearCache();
+}
+
+// Test 18: Glyph Atlas
+void testGlyphAtlas()
+{
+    printTestHeader("Glyph Atlas");
+    
+    LLArabicSupport& arabic = LLArabicSupport::instance();
+    if (!arabic.isInitialized())
+    {
+        printInfo("Needs a font (usage: test_arabic_support <font.ttf>), skipping");
+        return;
+    }
+    
+    const int width = 320;
+    const int height = 64;
+    std::vector<unsigned char> first(width * height, 0);
+    std::vector<unsigned char> second(width * height, 0);
+    
+    // Glyph indices every font has, standing in for a shaped word
+    std::wstring word;
+    word.push_back(36);
+    word.push_back(37);
+    word.push_back(38);
+    
+    LLArabicGlyphAtlas atlas;
+    int advance = atlas.drawText(word, 24, first.data(), width, height, width, 10, 40);
+    atlas.drawText(word, 24, second.data(), width, height, width, 30, 40);
+    
+    LLArabicGlyphAtlas::Stats stats;
+    atlas.getStats(stats);
+    bool drawn = std::count(first.begin(), first.end(), 0) < static_cast<long>(first.size());
+    if (advance > 0 && drawn && stats.mMisses == 1 && stats.mHits == 1)
+    {
+        printSuccess("A repeated run is copied from the atlas");
+    }
+    else
+    {
+        printFailure("Run was not drawn or not reused");
+    }
+    
+    // The same pixels, 20 pixels further right
+    bool same = true;
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x + 20 < width; ++x)
+        {
+            same = same && first[y * width + x] == second[y * width + x + 20];
+        }
+    }
+    if (same)
+    {
+        printSuccess("Cached runs blit to the pen position");
+    }
+    else
+    {
+        printFailure("Cached run differs from the first drawing");
+    }
+    
+    // Placed by HarfBuzz positions: the same glyphs raised by a mark offset
+    // are a run of their own, drawn that much higher
+    hb_glyph_position_t flat[3] = {};
+    hb_glyph_position_t raised[3] = {};
+    for (size_t i = 0; i < 3; ++i)
+    {
+        flat[i].x_advance = raised[i].x_advance = 20 * 64;
+        raised[i].y_offset = 10 * 64;
+    }
+    std::vector<unsigned char> low(width * height, 0);
+    std::vector<unsigned char> high(width * height, 0);
+    LLArabicGlyphAtlas positioned;
+    int positioned_advance = positioned.drawText(word, flat, 24, low.data(), width, height, width, 10, 40);
+    positioned.drawText(word, raised, 24, high.data(), width, height, width, 10, 40);
+    positioned.getStats(stats);
+    
+    bool placed = positioned_advance == 60 && stats.mMisses == 2 && stats.mHits == 0;
+    for (int y = 10; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            placed = placed && low[y * width + x] == high[(y - 10) * width + x];
+        }
+    }
+    if (placed)
+    {
+        printSuccess("Glyphs are placed by their HarfBuzz positions");
+    }
+    else
+    {
+        printFailure("HarfBuzz positions were not used or not part of the run key");
+    }
+    
+    // One page only: large runs push the least recently drawn ones out
+    LLArabicGlyphAtlas small(LLArabicGlyphAtlas::PAGE_SIZE * LLArabicGlyphAtlas::PAGE_SIZE);
+    std::vector<unsigned char> scratch(width * height, 0);
+    for (wchar_t glyph = 36; glyph < 136; ++glyph)
+    {
+        std::wstring run(3, glyph);
+        small.drawText(run, 96, scratch.data(), width, height, width, 0, 48);
+    }
+    small.getStats(stats);
+    std::cout << "  " << stats.mRuns << " runs on " << stats.mPages << " page, "
+              << stats.mEvictions << " evicted\n";
+    
+    small.drawText(std::wstring(3, 135), 96, scratch.data(), width, height, width, 0, 48);
+    small.drawText(std::wstring(3, 36), 96, scratch.data(), width, height, width, 0, 48);
+    LLArabicGlyphAtlas::Stats after;
+    small.getStats(after);
+    if (stats.mPages == 1 && stats.mEvictions > 0 &&
+        after.mHits == stats.mHits + 1 && after.mMisses == stats.mMisses + 1)
+    {
+        printSuccess("Least recently drawn runs are evicted at the pixel budget");
+    }
+    else
+    {
+        printFailure("Atlas went over budget or evicted recent runs");
+    }
+}
+
+// Visual order of a right-to-left paragraph straight from FriBidi
+std::wstring fribidiVisualOrder(const std::wstring& text)
+{
+    FriBidiStrIndex length = static_cast<FriBidiStrIndex>(text.size());
+    std::vector<FriBidiChar> visual(text.begin(), text.end());
+    std::vector<FriBidiCharType> types(text.size());
+    std::vector<FriBidiLevel> levels(text.size());
+    fribidi_get_bidi_types(visual.data(), length, types.data());
+    
+    FriBidiParType base_dir = FRIBIDI_PAR_RTL;
+    FriBidiLevel max_level = fribidi_get_par_embedding_levels(
+        types.data(), length, &base_dir, levels.data());
+    if (max_level > 1)
+    {
+        fribidi_reorder_line(FRIBIDI_FLAGS_DEFAULT, types.data(), length, 0, base_dir,
+                             levels.data(), visual.data(), nullptr);
+    }
+    return std::wstring(visual.begin(), visual.end());
+}
+
+// Test 19: Pure Right-to-Left Fast Path
+void testPureRTLReordering()
+{
+    printTestHeader("Pure Right-to-Left Fast Path");
+    
+    LLArabicSupport& arabic = LLArabicSupport::instance();
+    
+    // Generated lines of Arabic and Hebrew letters, marks (also at the
+    // start of a line and after spaces) and runs of spaces, short and long.
+    // Every fourth line gets a digit, Latin letter or neutral, so it has to
+    // go through FriBidi.
+    const wchar_t marks[] = { 0x064B, 0x064E, 0x0650, 0x0651, 0x0652, 0x0670 };
+    const wchar_t mixed[] = { L'7', 0x0663, L'a', L'.', L'(', L'!', L'\t', 0x200C, 0x00A0 };
+    std::mt19937 random(39);
+    std::vector<std::wstring> lines;
+    for (size_t n = 0; n < 20000; ++n)
+    {
+        size_t length = (n % 100 == 0) ? 300 + random() % 700 : 1 + random() % 80;
+        std::wstring line = (random() % 8 == 0) ? std::wstring(1, marks[random() % 6]) : L"";
+        line += static_cast<wchar_t>(0x0628 + random() % 32);
+        while (line.size() < length)
+        {
+            unsigned int pick = random() % 100;
+            if (pick < 60)
+            {
+                line += static_cast<wchar_t>(0x0621 + random() % 42);
+            }
+            else if (pick < 75)
+            {
+                line += marks[random() % 6];
+            }
+            else if (pick < 85)
+            {
+                line += static_cast<wchar_t>(0x05D0 + random() % 27);
+            }
+            else
+            {
+                line.append(1 + random() % 3, L' ');
+            }
+        }
+        if (n % 4 == 3)
+        {
+            line.insert(random() % (line.size() + 1), 1, mixed[random() % 9]);
+        }
+        lines.push_back(line);
+    }
+    
+    arabic.setEnableCache(false);
+    size_t mismatches = 0;
+    for (const std::wstring& line : lines)
+    {
+        if (arabic.reorderBidiText(line) != fribidiVisualOrder(line))
+        {
+            ++mismatches;
+        }
+    }
+    arabic.setEnableCache(true);
+    
+    std::cout << "  " << lines.size() << " lines, " << mismatches << " differ from FriBidi\n";
+    if (mismatches == 0)
+    {
+        printSuccess("Fast path gives the same visual order as FriBidi");
+    }
+    else
+    {
+        printFailure("Fast path and FriBidi disagree");
+    }
+}
+
+// Test 20: Shared Cache
+void testSharedCache()
+{
+    printTestHeader("Shared Cache");
+    
+#ifdef _WIN32
+    printInfo("Shared cache needs POSIX shared memory, skipping");
+#else
+    LLArabicSupport& arabic = LLArabicSupport::instance();
+    if (!arabic.isInitialized())
+    {
+        printInfo("Needs a font (usage: test_arabic_support <font.ttf>), skipping");
+        return;
+    }
+    
+    const std::string name = "/sela_arabic_test_" + std::to_string(getpid());
+    const std::string bad_name = name + "_bad";
+    if (!arabic.openSharedCache(name))
+    {
+        printInfo("Shared cache not built in (define LL_ARABIC_SHARED_CACHE to enable)");
+        return;
+    }
+    
+    std::wstring line = L"رسالة مشتركة بين النوافذ";
+    arabic.setEnableCache(false);
+    std::wstring expected = arabic.processArabicText(line, LLArabicSupport::CACHE_POOL_CHAT);
+    arabic.setEnableCache(true);
+    
+    // Another instance shaped the line: this process only has the segment
+    arabic.processArabicText(line, LLArabicSupport::CACHE_POOL_CHAT);
+    arabic.clearCache();
+    LLArabicSupport::CacheStats before;
+    arabic.getCacheStats(before);
+    std::wstring shared = arabic.processArabicText(line, LLArabicSupport::CACHE_POOL_CHAT);
+    LLArabicSupport::CacheStats after;
+    arabic.getCacheStats(after);
+    if (shared == expected && after.mSharedHits == before.mSharedHits + 1)
+    {
+        printSuccess("Text shaped once is found in the shared segment");
+    }
+    else
+    {
+        printFailure("Shared segment did not return the shaped text");
+    }
+    
+    // Damage the stored glyphs behind the cache's back
+    int fd = shm_open(name.c_str(), O_RDWR, 0600);
+    struct stat info;
+    bool damaged = false;
+    if (fd >= 0 && fstat(fd, &info) == 0)
+    {
+        void* memory = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (memory != MAP_FAILED)
+        {
+            wchar_t* begin = static_cast<wchar_t*>(memory);
+            wchar_t* end = begin + info.st_size / sizeof(wchar_t);
+            wchar_t* key = std::search(begin, end, line.begin(), line.end());
+            if (key + line.size() < end)
+            {
+                key[line.size()] ^= 0x55;
+                damaged = true;
+            }
+            munmap(memory, info.st_size);
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    
+    arabic.clearCache();
+    arabic.getCacheStats(before);
+    std::wstring recovered = arabic.processArabicText(line, LLArabicSupport::CACHE_POOL_CHAT);
+    arabic.getCacheStats(after);
+    if (damaged && recovered == expected && after.mSharedCorrupt == before.mSharedCorrupt + 1)
+    {
+        printSuccess("Damaged entries are detected and the text is shaped again");
+    }
+    else
+    {
+        printFailure("Damaged shared entry was not detected");
+    }
+    
+    // A segment of garbage is refused and the private cache carries on
+    fd = shm_open(bad_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0)
+    {
+        std::vector<unsigned char> garbage(4096, 0xAB);
+        if (write(fd, garbage.data(), garbage.size()) < 0)
+        {
+            printInfo("Could not fill the bad segment");
+        }
+        close(fd);
+    }
+    bool refused = !arabic.openSharedCache(bad_name);
+    arabic.clearCache();
+    if (refused && arabic.processArabicText(line, LLArabicSupport::CACHE_POOL_CHAT) == expected &&
+        arabic.processArabicText(line, LLArabicSupport::CACHE_POOL_CHAT) == expected)
+    {
+        printSuccess("Corrupt segments fall back to the private cache");
+    }
+    else
+    {
+        printFailure("Corrupt segment was used or broke processing");
+    }
+    
+    arabic.closeSharedCache();
+    shm_unlink(name.c_str());
+    shm_unlink(bad_name.c_str());
+#endif
+}
+
 // Main test runner
 int main(int argc, char* argv[])
 {
@@ -378,6 +1487,20 @@ int main(int argc, char* argv[])
         testCompleteProcessing();
         testUtf8Utilities();
         testCachingSystem();
+        testCacheAdmission();
+        testConcurrentReadScaling();
+        testCallerBuffers();
+        testPipelineTracing();
+        testDocumentProcessing();
+        testLazyFontLoading(argc > 1 ? argv[1] : "");
+        testTextLayout();
+        testCacheMemory();
+        testLocalCache();
+        testTextAnalysis();
+        testRunCache();
+        testGlyphAtlas();
+        testPureRTLReordering();
+        testSharedCache();
         
         // Summary
         std::cout << "\n" << CYAN << "═══════════════════════════════════════" << RESET << "\n";